@@ -1,5 +1,5 @@
 COMPILER="clang++"
-FLAGS="../src/wd_bridge.cpp ../src/wdfs.cpp ../src/bridge.cpp -o ../bin/wd_bridge `pkg-config fuse3 --cflags --libs && curl-config --libs`"
+FLAGS="../src/wd_bridge.cpp ../src/wdfs.cpp ../src/bridge.cpp ../src/read_ahead.cpp ../src/block_cache.cpp ../src/disk_cache.cpp ../src/write_buffer.cpp ../src/copy_engine.cpp ../src/shadow_file.cpp ../src/upload_queue.cpp ../src/upload_journal.cpp ../src/dentry_tree.cpp -o ../bin/wd_bridge `pkg-config fuse3 --cflags --libs && curl-config --libs`"
 ARCH_FLAGS=""
 if [ "$1" = "gcc" ]
 then
@@ -0,0 +1,151 @@
+#include "block_cache.hpp"
+#include "disk_cache.hpp"
+#include "log.h"
+#include <algorithm>
+
+const int block_cache::BLOCK_SIZE;
+
+block_cache::block_cache(long long _memory_budget, disk_cache *_disk) : memory_budget(_memory_budget), disk(_disk) {
+    pthread_mutex_init(&lock, NULL);
+}
+
+block_cache::~block_cache() {
+    pthread_mutex_destroy(&lock);
+}
+
+std::list<block_cache::entry>& block_cache::queue_of(queue_type queue) {
+    if (queue == QUEUE_IN) return in_queue;
+    if (queue == QUEUE_OUT) return out_queue;
+    return main_queue;
+}
+
+// Remove an entry from its queue and from the indexes
+void block_cache::remove_entry(std::list<entry>::iterator it) {
+    if (it->queue == QUEUE_IN) in_bytes -= it->data->size();
+    if (it->queue != QUEUE_OUT) {
+        memory_used -= it->data->size();
+        auto blocks = file_blocks.find(it->key.file_id);
+        if (blocks != file_blocks.end()) {
+            blocks->second.erase(it->key.block);
+            if (blocks->second.empty()) file_blocks.erase(blocks);
+        }
+    }
+    index.erase(it->key);
+    queue_of(it->queue).erase(it);
+}
+
+// Evict blocks until needed more bytes fit into the budget
+void block_cache::reclaim(long long needed) {
+    // Blocks seen once may take a quarter of the budget, the rest is kept for blocks that were hit again
+    long long in_budget = memory_budget / 4;
+    size_t out_capacity = std::max(1LL, memory_budget / BLOCK_SIZE / 2);
+
+    while (memory_used + needed > memory_budget && (!in_queue.empty() || !main_queue.empty())) {
+        if (!in_queue.empty() && (in_bytes > in_budget || main_queue.empty())) {
+            // Demote the oldest block seen once to a ghost entry, a scan never reaches the main queue
+            auto victim = std::prev(in_queue.end());
+            long long size = victim->data->size();
+            memory_used -= size;
+            in_bytes -= size;
+            auto blocks = file_blocks.find(victim->key.file_id);
+            if (blocks != file_blocks.end()) {
+                blocks->second.erase(victim->key.block);
+                if (blocks->second.empty()) file_blocks.erase(blocks);
+            }
+            victim->data.reset();
+            victim->queue = QUEUE_OUT;
+            out_queue.splice(out_queue.begin(), in_queue, victim);
+            if (out_queue.size() > out_capacity) remove_entry(std::prev(out_queue.end()));
+        } else {
+            remove_entry(std::prev(main_queue.end()));
+        }
+    }
+}
+
+block_data block_cache::lookup(const std::string &file_id, long long block) {
+    block_data result = lookup_memory(file_id, block);
+    if (result == NULL && disk != NULL) {
+        // Blocks loaded from the disk are kept in memory as well
+        result = disk->lookup(file_id, block);
+        if (result != NULL) insert_memory(file_id, block, result);
+    }
+    return result;
+}
+
+block_data block_cache::lookup_memory(const std::string &file_id, long long block) {
+    pthread_mutex_lock(&lock);
+    block_data result;
+    auto it = index.find(block_key { file_id, block });
+    if (it != index.end() && it->second->queue != QUEUE_OUT) {
+        result = it->second->data;
+        // Only the main queue is kept in LRU order
+        if (it->second->queue == QUEUE_MAIN) main_queue.splice(main_queue.begin(), main_queue, it->second);
+    }
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+void block_cache::insert(const std::string &file_id, long long block, block_data data) {
+    insert_memory(file_id, block, data);
+    if (disk != NULL) disk->insert(file_id, block, data);
+}
+
+void block_cache::insert_memory(const std::string &file_id, long long block, block_data data) {
+    if ((long long)data->size() > memory_budget) return;
+    pthread_mutex_lock(&lock);
+    block_key key { file_id, block };
+    queue_type target = QUEUE_IN;
+    auto it = index.find(key);
+    if (it != index.end()) {
+        if (it->second->queue == QUEUE_OUT) {
+            // Block was evicted recently and is needed again, it's part of the hot set
+            target = QUEUE_MAIN;
+        }
+        remove_entry(it->second);
+    }
+
+    reclaim(data->size());
+    std::list<entry> &queue = queue_of(target);
+    queue.push_front(entry { key, data, target });
+    index[key] = queue.begin();
+    file_blocks[file_id].insert(block);
+    memory_used += data->size();
+    if (target == QUEUE_IN) in_bytes += data->size();
+    pthread_mutex_unlock(&lock);
+}
+
+void block_cache::invalidate(const std::string &file_id) {
+    pthread_mutex_lock(&lock);
+    auto blocks = file_blocks.find(file_id);
+    if (blocks != file_blocks.end()) {
+        LOG("[block_cache]: Dropping %d cached blocks of %s\n", (int)blocks->second.size(), file_id.c_str());
+        std::vector<long long> to_remove(blocks->second.begin(), blocks->second.end());
+        for (long long block : to_remove) {
+            remove_entry(index[block_key { file_id, block }]);
+        }
+    }
+    versions.erase(file_id);
+    pthread_mutex_unlock(&lock);
+    if (disk != NULL) disk->invalidate(file_id);
+}
+
+void block_cache::validate(const std::string &file_id, long long size, const std::string &etag, time_t modification_time) {
+    pthread_mutex_lock(&lock);
+    auto it = versions.find(file_id);
+    bool changed = false;
+    if (it != versions.end()) {
+        changed = it->second.size != size || (!etag.empty() && !it->second.etag.empty() && it->second.etag != etag) ||
+            (modification_time != 0 && it->second.modification_time != 0 && it->second.modification_time != modification_time);
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (changed) invalidate(file_id);
+
+    pthread_mutex_lock(&lock);
+    file_version &version = versions[file_id];
+    version.size = size;
+    if (!etag.empty()) version.etag = etag;
+    if (modification_time != 0) version.modification_time = modification_time;
+    pthread_mutex_unlock(&lock);
+    if (disk != NULL) disk->validate(file_id, size, etag, modification_time);
+}
@@ -0,0 +1,86 @@
+#ifndef __BLOCK_CACHE_HPP_
+#define __BLOCK_CACHE_HPP_
+
+#include "pthread.h"
+#include <time.h>
+#include <string>
+#include <vector>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+
+class disk_cache;
+
+// Content of a cached block, shared with readers so eviction never frees data in use
+typedef std::shared_ptr<std::vector<char>> block_data;
+
+// In-memory cache of fixed-size file blocks with 2Q eviction, optionally backed by a disk cache
+class block_cache {
+    public:
+        static const int BLOCK_SIZE = 1024 * 1024;
+
+        // memory_budget is the maximum number of bytes held by resident blocks, disk may be NULL
+        block_cache(long long memory_budget, disk_cache *disk);
+        ~block_cache();
+
+        // Get a block of a file, returns NULL on a miss
+        block_data lookup(const std::string &file_id, long long block);
+        // Get a block of a file without falling back to the disk cache, returns NULL on a miss
+        block_data lookup_memory(const std::string &file_id, long long block);
+        // Store a block of a file, blocks shorter than BLOCK_SIZE are only valid at the end of the file
+        void insert(const std::string &file_id, long long block, block_data data);
+        // Drop every block of a file
+        void invalidate(const std::string &file_id);
+        // Drop the blocks of a file if its size, ETag or modification time changed since the last call,
+        // an empty etag or a modification_time of 0 isn't compared
+        void validate(const std::string &file_id, long long size, const std::string &etag, time_t modification_time = 0);
+
+    private:
+        struct block_key {
+            std::string file_id;
+            long long block;
+            bool operator==(const block_key &other) const { return block == other.block && file_id == other.file_id; }
+        };
+        struct block_key_hash {
+            size_t operator()(const block_key &key) const { return std::hash<std::string>()(key.file_id) ^ std::hash<long long>()(key.block); }
+        };
+        enum queue_type {
+            QUEUE_IN,  // Resident, seen once (FIFO)
+            QUEUE_OUT, // Ghost entry of a block evicted from QUEUE_IN (FIFO)
+            QUEUE_MAIN // Resident, seen more than once (LRU)
+        };
+        struct entry {
+            block_key key;
+            block_data data;
+            queue_type queue;
+        };
+        // Size, ETag and modification time of a file the cached blocks belong to
+        struct file_version {
+            long long size;
+            std::string etag;
+            time_t modification_time = 0;
+        };
+
+        long long memory_budget;
+        disk_cache *disk;
+        long long memory_used = 0;
+        // Bytes held by the blocks in the in queue
+        long long in_bytes = 0;
+        // Most recent entries are at the front of the queues
+        std::list<entry> in_queue;
+        std::list<entry> out_queue;
+        std::list<entry> main_queue;
+        std::unordered_map<block_key, std::list<entry>::iterator, block_key_hash> index;
+        // Resident blocks of each file
+        std::unordered_map<std::string, std::unordered_set<long long>> file_blocks;
+        std::unordered_map<std::string, file_version> versions;
+        pthread_mutex_t lock;
+
+        std::list<entry>& queue_of(queue_type queue);
+        void remove_entry(std::list<entry>::iterator it);
+        void reclaim(long long needed);
+        void insert_memory(const std::string &file_id, long long block, block_data data);
+};
+
+#endif
@@ -1,13 +1,23 @@
 #include "../include/json.hpp"
 #include "../include/fmt/core.h"
 #include "bridge.hpp"
+#include "concurrent_map.hpp"
 #include "pthread.h"
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <curl/curl.h>
 #include <string>
 #include <vector>
 #include <time.h>
 #include <string_view>
+#include <functional>
+#include <memory>
+#include <future>
+#include <unordered_set>
+#include <algorithm>
 
 #define DEBUG_TIME
 
@@ -16,22 +26,51 @@ using json = nlohmann::json;
 // Data to pass around in CURL header callback
 struct response_data {
     // Status code of the request
-    int status_code;
+    int status_code = 0;
     // Header key value pairs
     std::unordered_map<std::string, std::string> headers;
     // Response body
     std::string response_body;
+    // Number of body bytes written to a caller supplied buffer
+    int bytes_received = 0;
+    // Transfer timings of the request
+    bridge::transfer_timing timing;
 };
 
 // Data for reading response as a buffer
 struct buffer_result {
     int bytes_read;
     char *buffer;
-    buffer_result(int bytes, char* buf) : bytes_read(bytes), buffer(buf) {}
+    // Number of bytes the buffer can still hold
+    int capacity;
+    buffer_result(int bytes, char* buf, int cap) : bytes_read(bytes), buffer(buf), capacity(cap) {}
 };
 
-// Map request urls to etags
-std::unordered_map<std::string, std::string> etag_mapping;
+// Called on the network thread when a request finishes
+typedef std::function<void(response_data &rd, CURLcode res)> completion_handler;
+
+// A request handed over to the network thread
+// Request body read from a file descriptor while it's being sent
+struct upload_source {
+    int fd;
+    long long offset;
+    long long remaining;
+};
+
+struct async_request {
+    CURL *curl = NULL;
+    struct curl_slist *chunk = NULL;
+    std::string url;
+    response_data rd;
+    // Destination of the response body when it's collected as raw bytes
+    buffer_result bytes = buffer_result(0, NULL, 0);
+    // Source of the request body when it's streamed from a file
+    upload_source upload = upload_source { -1, 0, 0 };
+    completion_handler on_done;
+};
+
+// Map request urls to etags, read by the fuse worker threads and updated from the network thread
+concurrent_map<std::string> etag_mapping;
 
 // Store the URL start with the given remote device endpoint
 std::string request_start;
@@ -42,6 +81,45 @@ CURLSH *share;
 // Mutex array for shared curl handle locking
 std::vector<pthread_mutex_t> mutex_list(5);
 
+// Pool of idle CURL easy handles, kept alive between requests
+std::vector<CURL*> handle_pool;
+
+// Mutex for the easy handle pool
+pthread_mutex_t handle_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Multi handle driven by the network thread
+CURLM *multi;
+
+// epoll instance watching the sockets of the multi handle
+int epoll_fd = -1;
+
+// eventfd used to wake up the network thread
+int wakeup_fd = -1;
+
+// Maximum number of parallel connections opened to the device
+const long MAX_HOST_CONNECTIONS = 16;
+
+// Network thread running the multi handle
+pthread_t network_thread;
+
+// Set to false to stop the network thread
+volatile bool network_running = false;
+
+// Set once the event loop failed, new requests are failed right away instead of waiting forever
+bool network_failed = false;
+
+// Absolute deadline of the multi handle timer in milliseconds, -1 if there's none
+long long multi_deadline = -1;
+
+// Requests currently added to the multi handle, only touched by the network thread
+std::unordered_set<async_request*> active_requests;
+
+// Requests waiting to be added to the multi handle
+std::vector<async_request*> submit_queue;
+
+// Mutex for the submit queue
+pthread_mutex_t submit_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 int lock_data_to_int(curl_lock_data data) {
     switch (data) {
         case CURL_LOCK_DATA_COOKIE:
@@ -69,11 +147,35 @@ void curl_share_unlock(CURL *handle, curl_lock_data data, void *userptr) {
 }
 
 
+// Check out an easy handle from the pool, or create a new one if the pool is empty
+static CURL* acquire_handle() {
+    CURL *curl = NULL;
+    pthread_mutex_lock(&handle_pool_mutex);
+    if (!handle_pool.empty()) {
+        curl = handle_pool.back();
+        handle_pool.pop_back();
+    }
+    pthread_mutex_unlock(&handle_pool_mutex);
+
+    if (curl == NULL) return curl_easy_init();
+    // Clear the options of the previous request, the connection, TLS session and DNS caches are kept
+    curl_easy_reset(curl);
+    return curl;
+}
+
+// Return an easy handle to the pool for later reuse
+static void release_handle(CURL *curl) {
+    pthread_mutex_lock(&handle_pool_mutex);
+    handle_pool.push_back(curl);
+    pthread_mutex_unlock(&handle_pool_mutex);
+}
+
 // Convert the given timestamp to the required format by the server
 std::string to_iso_time(const time_t &t) {
     // Note: time_t is passed by fuse
-    struct tm *tmp;
-    tmp = localtime(&t);
+    // Called from fuse and upload threads at once, localtime's shared buffer isn't safe
+    struct tm local_time;
+    struct tm *tmp = localtime_r(&t, &local_time);
     if (tmp == NULL) {
         fprintf(stderr, "[get_formatted_time]: Failed to get local time\n");
         return std::string("");
@@ -95,6 +197,29 @@ std::string to_iso_time(const time_t &t) {
     return std::string(formatted_result + str_offset);
 }
 
+// Parse an RFC3339 time sent by the remote into seconds since the epoch, returns 0 if it can't be parsed
+time_t from_iso_time(const std::string &iso_time) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    int consumed = 0;
+    if (sscanf(iso_time.c_str(), "%d-%d-%dT%d:%d:%d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &consumed) != 6) return 0;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    time_t result = timegm(&tm);
+    // Fractions of a second are dropped, a UTC offset is applied
+    const char *rest = iso_time.c_str() + consumed;
+    if (*rest == '.') {
+        rest++;
+        while (*rest >= '0' && *rest <= '9') rest++;
+    }
+    int offset_hours = 0, offset_minutes = 0;
+    if ((*rest == '+' || *rest == '-') && sscanf(rest + 1, "%d:%d", &offset_hours, &offset_minutes) == 2) {
+        long offset = offset_hours * 3600L + offset_minutes * 60L;
+        result += *rest == '+' ? -offset : offset;
+    }
+    return result;
+}
+
 // Get the current time in the required format
 std::string get_formatted_time() {
     // Get current time
@@ -105,7 +230,7 @@ std::string get_formatted_time() {
 
 // Get status code and collect headers
 static size_t header_callback(char *buffer, size_t size, size_t nitems, void *userdata) {
-    std::string buf(buffer);
+    std::string buf(buffer, size * nitems);
     int colon_index = buf.find(":");
     int http_index = buf.find("HTTP/");
     response_data *data = (response_data *)userdata;
@@ -114,7 +239,8 @@ static size_t header_callback(char *buffer, size_t size, size_t nitems, void *us
         int first_space = buf.find_first_of(" ");
         int next_space = buf.find(" ", first_space + 1);
         std::string status_code = buf.substr(first_space + 1, next_space - first_space - 1);
-        data->status_code = std::stoi(status_code);
+        // Runs on the network thread, a malformed status line must not throw
+        data->status_code = (int)strtol(status_code.c_str(), NULL, 10);
     } else if (colon_index != -1) {
         std::string name = buf.substr(0, colon_index);
         // Additional -2 from substring size to remove the trailing \r\n
@@ -126,21 +252,137 @@ static size_t header_callback(char *buffer, size_t size, size_t nitems, void *us
 
 static size_t collect_response_string(void *content, size_t size, size_t nmemb, std::string *data) {
     char *strContent = (char *)content;
-    data->append(strContent);
+    data->append(strContent, size * nmemb);
     return size * nmemb;
 }
 
 static size_t collect_response_bytes(void *content, size_t size, size_t nmemb, buffer_result *data) {
     int i_size = (int)size * (int)nmemb;
+    // Server sent more than requested, abort the transfer instead of overflowing the buffer
+    if (i_size > data->capacity) return 0;
     memcpy(data->buffer, content, size * nmemb);
     data->bytes_read += i_size;
     data->buffer += sizeof(char) * i_size;
+    data->capacity -= i_size;
     return size * nmemb;
 }
 
+static size_t read_upload_body(char *buffer, size_t size, size_t nitems, upload_source *source) {
+    size_t to_read = std::min((long long)(size * nitems), source->remaining);
+    if (to_read == 0) return 0;
+    ssize_t n = pread(source->fd, buffer, to_read, source->offset);
+    // File ended before the announced body size, the request can't be completed
+    if (n <= 0) return CURL_READFUNC_ABORT;
+    source->offset += n;
+    source->remaining -= n;
+    return n;
+}
+
+// Get the previously received ETag of a request url
+static bool get_etag(const std::string &url, std::string &etag) {
+    return etag_mapping.get(url, etag);
+}
+
+// Store the ETag of a response, if the server sent one
+static void update_etag(const std::string &url, response_data &rd) {
+    if (rd.headers.find("etag") == rd.headers.end()) return;
+    etag_mapping.set(url, rd.headers["etag"]);
+}
+
+// Reads the entries of a listing response into entry_data while it's parsed, without building the JSON document
+// Only the fields of the objects in the top level "files" array are kept, values nested deeper are skipped
+class listing_parser : public nlohmann::json_sax<json> {
+    public:
+        listing_parser(std::vector<bridge::entry_data> &entries) : entries(entries) {}
+
+        bool null() override { return true; }
+        bool boolean(bool) override { return true; }
+        bool number_integer(number_integer_t val) override { return number(val); }
+        bool number_unsigned(number_unsigned_t val) override { return number(val); }
+        bool number_float(number_float_t, const string_t&) override { return true; }
+        bool string(string_t &val) override {
+            if (!in_entry()) return true;
+            bridge::entry_data &entry = entries.back();
+            switch (field) {
+                case FIELD_ID: entry.id = std::move(val); break;
+                case FIELD_NAME: entry.name = std::move(val); break;
+                case FIELD_PARENT_ID: entry.parent_id = std::move(val); break;
+                case FIELD_MIME_TYPE: entry.is_dir = val == "application/x.wd.dir"; break;
+                case FIELD_MODIFIED: entry.modification_time = from_iso_time(val); break;
+                case FIELD_CHANGED: entry.change_time = from_iso_time(val); break;
+                default: break;
+            }
+            return true;
+        }
+        bool start_object(std::size_t) override {
+            depth++;
+            if (depth == 3 && in_files) entries.emplace_back();
+            return true;
+        }
+        bool key(string_t &val) override {
+            if (depth == 1) files_key = val == "files";
+            else if (depth == 3 && in_files) field = field_of(val);
+            return true;
+        }
+        bool end_object() override {
+            depth--;
+            field = FIELD_NONE;
+            return true;
+        }
+        bool start_array(std::size_t) override {
+            depth++;
+            if (depth == 2 && files_key) in_files = true;
+            return true;
+        }
+        bool end_array() override {
+            if (depth == 2) in_files = false;
+            depth--;
+            return true;
+        }
+        bool parse_error(std::size_t, const std::string&, const nlohmann::detail::exception&) override { return false; }
+
+    private:
+        enum entry_field {
+            FIELD_NONE,
+            FIELD_ID,
+            FIELD_NAME,
+            FIELD_PARENT_ID,
+            FIELD_MIME_TYPE,
+            FIELD_SIZE,
+            FIELD_MODIFIED,
+            FIELD_CHANGED
+        };
+
+        std::vector<bridge::entry_data> &entries;
+        // Nesting of the current value, 1 inside the response object, 3 inside an entry
+        int depth = 0;
+        // Last key of the response object was "files", and the array of entries is being read
+        bool files_key = false;
+        bool in_files = false;
+        // Field of the entry the next value belongs to
+        entry_field field = FIELD_NONE;
+
+        bool in_entry() const { return depth == 3 && in_files && !entries.empty(); }
+        template <typename T>
+        bool number(T val) {
+            if (in_entry() && field == FIELD_SIZE) entries.back().size = (long long) val;
+            return true;
+        }
+        static entry_field field_of(const std::string &key) {
+            if (key == "id") return FIELD_ID;
+            if (key == "name") return FIELD_NAME;
+            if (key == "parentID") return FIELD_PARENT_ID;
+            if (key == "mimeType") return FIELD_MIME_TYPE;
+            if (key == "size") return FIELD_SIZE;
+            if (key == "mTime") return FIELD_MODIFIED;
+            if (key == "cTime") return FIELD_CHANGED;
+            return FIELD_NONE;
+        }
+};
+
 // Initialize a basic request
-static CURL* request_base(std::string_view method, const std::string& url, const std::vector<std::string> &headers, const char *request_body, long size, response_data &rd, struct curl_slist *chunk) {
-    CURL *curl = curl_easy_init();
+static CURL* request_base(std::string_view method, const std::string& url, const std::vector<std::string> &headers, const char *request_body, long size, response_data &rd, struct curl_slist *&chunk) {
+    CURL *curl = acquire_handle();
     if (curl) {
         // Set shared CURL handle
         curl_easy_setopt(curl, CURLOPT_SHARE, share);
@@ -148,6 +390,8 @@ static CURL* request_base(std::string_view method, const std::string& url, const
         curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
         // Disable IPv6 DNS resolving, as it sometimes results in large timeouts
         curl_easy_setopt(curl, CURLOPT_IPRESOLVE, CURL_IPRESOLVE_V4);
+        // Keep idle pooled connections alive between requests
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
         // Set header callback
         curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_callback);
         // Set object to pass to header callback
@@ -176,19 +420,18 @@ static CURL* request_base(std::string_view method, const std::string& url, const
 static void request_free(CURL *curl, struct curl_slist *chunk, CURLcode res) {
     if (res != CURLE_OK) fprintf(stderr, "request failed: %s\n", curl_easy_strerror(res));
     curl_slist_free_all(chunk);
-    curl_easy_cleanup(curl);
+    release_handle(curl);
 }
 
 static std::string encode_url_part(const char* url_part) {
-    // Init curl
-    CURL *curl;
-    curl = curl_easy_init();
+    // Borrow a handle from the pool
+    CURL *curl = acquire_handle();
     // Escape URL part
     char *escaped = curl_easy_escape(curl, url_part, strlen(url_part));
     std::string str_escaped(escaped);
-    // Free char pointer and curl
+    // Free char pointer and return the handle
     curl_free(escaped);
-    curl_easy_cleanup(curl);
+    release_handle(curl);
     return str_escaped;
 }
 
@@ -212,28 +455,259 @@ static void debug_trip_time(CURL *curl, const std::string& url) {
 }
 #endif
 
-// Perform a single request and get string response
-static response_data make_request(std::string_view method, const std::string& url, const std::vector<std::string> &headers, const char *request_body, long size) {
-    CURLcode res;
-    response_data rd;
-    std::string response_body;
-    struct curl_slist *chunk = NULL;
+// Get the current time of the monotonic clock in milliseconds
+static long long monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    // Configure base request
-    CURL *curl = request_base(method, url, headers, request_body, size, rd, chunk);
-    if (curl) {
-        // Collect response body
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, collect_response_string);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response_body);
+// Keep the epoll set in sync with the sockets the multi handle wants to watch
+static int multi_socket_callback(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp) {
+    if (what == CURL_POLL_REMOVE) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s, NULL);
+        curl_multi_assign(multi, s, NULL);
+        return 0;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.data.fd = s;
+    if (what & CURL_POLL_IN) ev.events |= EPOLLIN;
+    if (what & CURL_POLL_OUT) ev.events |= EPOLLOUT;
 
-        res = curl_easy_perform(curl);
-        rd.response_body = response_body;
+    if (socketp == NULL) {
+        // First time we see this socket, mark it as registered
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s, &ev) < 0 && errno == EEXIST) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s, &ev);
+        }
+        curl_multi_assign(multi, s, &epoll_fd);
+    } else if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s, &ev) < 0 && errno == ENOENT) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s, &ev);
+    }
+    return 0;
+}
+
+// Store the timeout the multi handle asked for
+static int multi_timer_callback(CURLM *multi_handle, long timeout_ms, void *userp) {
+    multi_deadline = timeout_ms < 0 ? -1 : monotonic_ms() + timeout_ms;
+    return 0;
+}
+
+// Finish a request and hand the results over to its completion handler
+static void complete_request(async_request *req, CURLcode res) {
+    if (req->curl != NULL) {
 #ifdef DEBUG_TIME
-        debug_trip_time(curl, url);
+        if (res == CURLE_OK) debug_trip_time(req->curl, req->url);
 #endif
-        request_free(curl, chunk, res);
+        curl_off_t first_byte, total;
+        curl_easy_getinfo(req->curl, CURLINFO_STARTTRANSFER_TIME_T, &first_byte);
+        curl_easy_getinfo(req->curl, CURLINFO_TOTAL_TIME_T, &total);
+        req->rd.timing.first_byte_us = first_byte;
+        req->rd.timing.total_us = total;
+        request_free(req->curl, req->chunk, res);
+    }
+    req->rd.bytes_received = req->bytes.bytes_read;
+    req->on_done(req->rd, res);
+    delete req;
+}
+
+// Collect the finished transfers of the multi handle
+static void check_multi_info() {
+    CURLMsg *msg;
+    int msgs_left;
+    while ((msg = curl_multi_info_read(multi, &msgs_left)) != NULL) {
+        if (msg->msg != CURLMSG_DONE) continue;
+        async_request *req;
+        CURL *curl = msg->easy_handle;
+        CURLcode res = msg->data.result;
+        curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char**)&req);
+        curl_multi_remove_handle(multi, curl);
+        active_requests.erase(req);
+        complete_request(req, res);
+    }
+}
+
+// Move the submitted requests into the multi handle
+static void drain_submit_queue() {
+    std::vector<async_request*> pending;
+    pthread_mutex_lock(&submit_mutex);
+    pending.swap(submit_queue);
+    pthread_mutex_unlock(&submit_mutex);
+
+    for (async_request *req : pending) {
+        CURLMcode mres = curl_multi_add_handle(multi, req->curl);
+        if (mres != CURLM_OK) {
+            fprintf(stderr, "failed to add request to the multi handle: %s\n", curl_multi_strerror(mres));
+            complete_request(req, CURLE_FAILED_INIT);
+        } else {
+            active_requests.insert(req);
+        }
+    }
+}
+
+// Event loop of the network thread
+static void* network_loop(void *arg) {
+    const int MAX_EVENTS = 64;
+    struct epoll_event events[MAX_EVENTS];
+    int running_handles = 0;
+
+    while (network_running) {
+        int timeout = -1;
+        if (multi_deadline != -1) {
+            long long remaining = multi_deadline - monotonic_ms();
+            timeout = remaining < 0 ? 0 : (int)remaining;
+        }
+
+        int event_count = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        if (event_count < 0 && errno != EINTR) {
+            // Not transient, stop taking requests so the callers get an error
+            fprintf(stderr, "[network_loop]: epoll_wait failed: %s\n", strerror(errno));
+            pthread_mutex_lock(&submit_mutex);
+            network_failed = true;
+            pthread_mutex_unlock(&submit_mutex);
+            break;
+        }
+
+        for (int i = 0; i < event_count; i++) {
+            if (events[i].data.fd == wakeup_fd) {
+                // New requests were submitted
+                uint64_t counter;
+                if (::read(wakeup_fd, &counter, sizeof(counter)) < 0) continue;
+                drain_submit_queue();
+                continue;
+            }
+            int action = 0;
+            if (events[i].events & EPOLLIN) action |= CURL_CSELECT_IN;
+            if (events[i].events & EPOLLOUT) action |= CURL_CSELECT_OUT;
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) action |= CURL_CSELECT_ERR;
+            curl_multi_socket_action(multi, events[i].data.fd, action, &running_handles);
+        }
+
+        if (multi_deadline != -1 && monotonic_ms() >= multi_deadline) {
+            multi_deadline = -1;
+            curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &running_handles);
+        }
+
+        check_multi_info();
+    }
+
+    // Fail the requests that didn't finish before shutdown
+    drain_submit_queue();
+    for (async_request *req : active_requests) {
+        curl_multi_remove_handle(multi, req->curl);
+        complete_request(req, CURLE_ABORTED_BY_CALLBACK);
+    }
+    active_requests.clear();
+    return NULL;
+}
+
+// Start the network thread
+static bool start_network_thread() {
+    network_running = true;
+    if (pthread_create(&network_thread, NULL, network_loop, NULL) != 0) {
+        network_running = false;
+        return false;
+    }
+    return true;
+}
+
+// Stop the network thread, unfinished requests are failed
+static void stop_network_thread() {
+    if (!network_running) return;
+    network_running = false;
+    uint64_t one = 1;
+    if (::write(wakeup_fd, &one, sizeof(one)) < 0) {
+        fprintf(stderr, "[stop_network_thread]: Failed to wake up the network thread\n");
+    }
+    pthread_join(network_thread, NULL);
+}
+
+// Threads don't survive a fork, fuse forks when it daemonizes after the login requests
+static bool network_paused = false;
+static void network_before_fork() {
+    network_paused = network_running;
+    stop_network_thread();
+}
+static void network_after_fork_parent() {
+    if (network_paused) start_network_thread();
+    network_paused = false;
+}
+static void network_after_fork_child() {
+    if (network_paused) {
+        // The event sources are shared with the parent, the child needs its own
+        close(epoll_fd);
+        close(wakeup_fd);
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = wakeup_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &ev);
+        multi_deadline = -1;
+        start_network_thread();
+    }
+    network_paused = false;
+}
+
+// Hand a request over to the network thread, on_done is called on the network thread once it finishes
+// If bytes is set, the response body is written to it instead of being collected as a string
+// If upload is set, the request body is read from its file instead of request_body
+static void submit_request(std::string_view method, const std::string& url, const std::vector<std::string> &headers, const char *request_body, long size, completion_handler on_done, buffer_result *bytes = NULL, long timeout = 0L, const upload_source *upload = NULL) {
+    async_request *req = new async_request();
+    req->url = url;
+    req->on_done = std::move(on_done);
+
+    // Configure base request
+    req->curl = request_base(method, url, headers, request_body, size, req->rd, req->chunk);
+    if (req->curl == NULL) {
+        complete_request(req, CURLE_FAILED_INIT);
+        return;
+    }
+
+    curl_easy_setopt(req->curl, CURLOPT_PRIVATE, req);
+    if (bytes != NULL) {
+        req->bytes = *bytes;
+        curl_easy_setopt(req->curl, CURLOPT_WRITEFUNCTION, collect_response_bytes);
+        curl_easy_setopt(req->curl, CURLOPT_WRITEDATA, &req->bytes);
+    } else {
+        curl_easy_setopt(req->curl, CURLOPT_WRITEFUNCTION, collect_response_string);
+        curl_easy_setopt(req->curl, CURLOPT_WRITEDATA, &req->rd.response_body);
+    }
+    if (timeout > 0) curl_easy_setopt(req->curl, CURLOPT_TIMEOUT, timeout);
+    if (upload != NULL) {
+        req->upload = *upload;
+        curl_easy_setopt(req->curl, CURLOPT_UPLOAD, 1L);
+        curl_easy_setopt(req->curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)upload->remaining);
+        curl_easy_setopt(req->curl, CURLOPT_READFUNCTION, read_upload_body);
+        curl_easy_setopt(req->curl, CURLOPT_READDATA, &req->upload);
     }
-    return rd;
+
+    pthread_mutex_lock(&submit_mutex);
+    bool failed = network_failed;
+    if (!failed) submit_queue.push_back(req);
+    pthread_mutex_unlock(&submit_mutex);
+    if (failed) {
+        complete_request(req, CURLE_FAILED_INIT);
+        return;
+    }
+
+    // Wake up the network thread
+    uint64_t one = 1;
+    if (::write(wakeup_fd, &one, sizeof(one)) < 0) {
+        fprintf(stderr, "[submit_request]: Failed to wake up the network thread\n");
+    }
+}
+
+// Perform a single request and get string response
+static response_data make_request(std::string_view method, const std::string& url, const std::vector<std::string> &headers, const char *request_body, long size) {
+    auto result = std::make_shared<std::promise<response_data>>();
+    std::future<response_data> future = result->get_future();
+    submit_request(method, url, headers, request_body, size, [result](response_data &rd, CURLcode res) {
+        result->set_value(std::move(rd));
+    });
+    return future.get();
 }
 
 // Generic handler for responses from remote
@@ -274,33 +748,17 @@ bool get_device_endpoints(const std::string &auth_token, std::string_view device
 
 // Test the connection to a given endpoint
 bool test_connection(const std::string& endpoint) {
-    // Data for CURL request
-    CURLcode res;
-    response_data rd;
-    std::string response_body;
-    struct curl_slist *chunk = NULL;
-
     // URL + empty headers
     const std::string request_url = fmt::format("{}/sdk/v1/device?fields=id", endpoint);
     std::vector<std::string> headers;
 
-    // Construct the options request
-    CURL *curl = request_base("OPTIONS", request_url, headers, NULL, 0L, rd, chunk);
-    if (curl) {
-        // Collect response body
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, collect_response_string);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response_body);
-
-        // Set lower timeout (5 seconds) for test
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 5L);
-
-        res = curl_easy_perform(curl);
-        rd.response_body = response_body;
-        bool con_result = res != CURLE_OPERATION_TIMEDOUT;
-        request_free(curl, chunk, res);
-        return con_result;
-    }
-    return false;
+    // Construct the options request with a lower timeout (5 seconds) for the test
+    auto result = std::make_shared<std::promise<bool>>();
+    std::future<bool> future = result->get_future();
+    submit_request("OPTIONS", request_url, headers, NULL, 0L, [result](response_data &rd, CURLcode res) {
+        result->set_value(res != CURLE_OPERATION_TIMEDOUT);
+    }, NULL, 5L);
+    return future.get();
 }
 
 namespace bridge {
@@ -329,11 +787,54 @@ namespace bridge {
         curl_share_setopt(share, CURLSHOPT_LOCKFUNC, curl_share_lock);
         curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, curl_share_unlock);
 
+        // Init the multi handle and the event sources of the network thread
+        multi = curl_multi_init();
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (multi == NULL || epoll_fd < 0 || wakeup_fd < 0) {
+            return false;
+        }
+        curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, multi_socket_callback);
+        curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, multi_timer_callback);
+        // Requests above the limit are queued by CURL until a connection frees up
+        curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, MAX_HOST_CONNECTIONS);
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = wakeup_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &ev);
+
+        // Start the network thread
+        if (!start_network_thread()) {
+            return false;
+        }
+        static bool fork_handlers_set = false;
+        if (!fork_handlers_set) {
+            pthread_atfork(network_before_fork, network_after_fork_parent, network_after_fork_child);
+            fork_handlers_set = true;
+        }
+
         return true;
     }
 
     // Release the network bridge
     void release_bridge() {
+        stop_network_thread();
+        if (multi != NULL) curl_multi_cleanup(multi);
+        multi = NULL;
+        if (epoll_fd >= 0) close(epoll_fd);
+        if (wakeup_fd >= 0) close(wakeup_fd);
+        epoll_fd = wakeup_fd = -1;
+
+        // Release pooled easy handles before the shared session they are attached to
+        pthread_mutex_lock(&handle_pool_mutex);
+        for (CURL *curl : handle_pool) {
+            curl_easy_cleanup(curl);
+        }
+        handle_pool.clear();
+        pthread_mutex_unlock(&handle_pool_mutex);
+
         // Release shared CURL session
         curl_share_cleanup(share);
 
@@ -378,80 +879,60 @@ namespace bridge {
         return false;
     }
 
-    // List entries on the remote device
-    request_result list_entries(const std::string& path, const std::string &auth_token, std::vector<entry_data> &entries) {
-        const std::string request_url = fmt::format("{}sdk/v2/filesSearch/parents?ids={}&fields=id,mimeType,name,size&pretty=false&orderBy=name&order=asc;", request_start, path);
+    // Request a listing, the body is parsed by the thread getting the result instead of the network thread
+    static std::future<request_result> request_listing(const std::string &request_url, const std::string &auth_token, std::vector<entry_data> &entries) {
         std::vector<std::string> headers {
             auth_token
         };
 
-        if (etag_mapping.find(request_url) != etag_mapping.end()) {
+        std::string etag;
+        if (get_etag(request_url, etag)) {
             // We have a previous ETag, add if-none-match to the headers
-            headers.emplace_back("If-None-Match: " + etag_mapping[request_url]);
+            headers.emplace_back("If-None-Match: " + etag);
         }
 
-        response_data rd = make_request("GET", request_url, headers, NULL, 0L);
-        if (rd.status_code == 304) {
-            // Entries haven't changed since last run
-            return REQUEST_CACHED;
-        } else if (generic_handler(rd.status_code, rd.response_body)) {
-            // Update ETag mapping
-            if (rd.headers.find("etag") != rd.headers.end()) {
-                etag_mapping[request_url] = rd.headers["etag"];
+        auto response = std::make_shared<std::promise<response_data>>();
+        std::future<response_data> body = response->get_future();
+        submit_request("GET", request_url, headers, NULL, 0L, [response](response_data &rd, CURLcode res) {
+            response->set_value(std::move(rd));
+        });
+        return std::async(std::launch::deferred, [body = std::move(body), request_url, &entries]() mutable {
+            response_data rd = body.get();
+            if (rd.status_code == 304) {
+                // Entries haven't changed since last run
+                return REQUEST_CACHED;
             }
-            auto json_response = json::parse(rd.response_body);
-            auto folder_contents = json_response["files"];
-            entries.resize(folder_contents.size());
-            for (int i = 0; i < folder_contents.size(); i++) {
-                std::string id = folder_contents[i]["id"];
-                std::string name = folder_contents[i]["name"];
-                bool is_dir = folder_contents[i]["mimeType"] == "application/x.wd.dir";
-                int size = 0;
-                if (folder_contents[i]["size"] != nullptr) size = folder_contents[i]["size"];
-                entry_data entry(size, is_dir, std::move(id), std::move(name));
-                entries[i] = entry;
+            if (!generic_handler(rd.status_code, rd.response_body)) return REQUEST_FAILED;
+            entries.clear();
+            listing_parser parser(entries);
+            if (!json::sax_parse(rd.response_body, &parser)) {
+                entries.clear();
+                return REQUEST_FAILED;
             }
+            // Update ETag mapping, only for a listing that was understood
+            update_etag(request_url, rd);
             return REQUEST_SUCCESS;
-        }
-        return REQUEST_FAILED;
+        });
     }
 
-    // List entries on the remote system for multiple entries
-    request_result list_entries_multiple(const std::string& ids, const std::string &auth_token, std::vector<entry_data> &entries) {
-        const std::string request_url = fmt::format("{}sdk/v2/filesSearch/parents?ids={}&fields=id,mimeType,name,parentID&pretty=false&orderBy=name&order=asc;", request_start, ids);
-
-        std::vector<std::string> headers {
-            auth_token
-        };
+    // List entries on the remote device
+    std::future<request_result> list_entries_async(const std::string& path, const std::string &auth_token, std::vector<entry_data> &entries) {
+        const std::string request_url = fmt::format("{}sdk/v2/filesSearch/parents?ids={}&fields=id,mimeType,name,size,mTime,cTime&pretty=false&orderBy=name&order=asc;", request_start, path);
+        return request_listing(request_url, auth_token, entries);
+    }
 
-        if (etag_mapping.find(request_url) != etag_mapping.end()) {
-            // We have a previous ETag, add if-none-match to the headers
-            headers.emplace_back("If-None-Match: " + etag_mapping[request_url]);
-        }
+    request_result list_entries(const std::string& path, const std::string &auth_token, std::vector<entry_data> &entries) {
+        return list_entries_async(path, auth_token, entries).get();
+    }
 
-        response_data rd = make_request("GET", request_url, headers, NULL, 0L);
-        if (rd.status_code == 304) {
-            return REQUEST_CACHED;
-        } else if (generic_handler(rd.status_code, rd.response_body)) {
-            // Update ETag mapping
-            if (rd.headers.find("etag") != rd.headers.end()) {
-                etag_mapping[request_url] = rd.headers["etag"];
-            }
+    // List entries on the remote system for multiple entries, ids is a comma separated list
+    std::future<request_result> list_entries_multiple_async(const std::string& ids, const std::string &auth_token, std::vector<entry_data> &entries) {
+        const std::string request_url = fmt::format("{}sdk/v2/filesSearch/parents?ids={}&fields=id,mimeType,name,parentID&pretty=false&orderBy=name&order=asc;", request_start, ids);
+        return request_listing(request_url, auth_token, entries);
+    }
 
-            auto json_response = json::parse(rd.response_body);
-            auto folder_contents = json_response["files"];
-            entries.resize(folder_contents.size());
-            for (int i = 0; i < folder_contents.size(); i++) {
-                std::string id = folder_contents[i]["id"];
-                std::string name = folder_contents[i]["name"];
-                bool is_dir = folder_contents[i]["mimeType"] == "application/x.wd.dir";
-                std::string parent_id = folder_contents[i]["parentID"];
-                entry_data entry(is_dir, std::move(id), std::move(name), std::move(parent_id));
-                entries[i] = entry;
-            }
-            return REQUEST_SUCCESS;
-        }
-        return REQUEST_FAILED;
+    request_result list_entries_multiple(const std::string& ids, const std::string &auth_token, std::vector<entry_data> &entries) {
+        return list_entries_multiple_async(ids, auth_token, entries).get();
     }
 
     // Create a new folder on the remote system
@@ -484,28 +965,29 @@ namespace bridge {
     }
 
     // Remove an entry from the remote system
-    bool remove_entry(const std::string &entry_id, const std::string &auth_token) {
+    std::future<bool> remove_entry_async(const std::string &entry_id, const std::string &auth_token) {
         const std::string request_url = fmt::format("{}sdk/v2/files/{}", request_start, entry_id);
 
         std::vector<std::string> headers {
             auth_token
         };
 
-        response_data rd = make_request("DELETE", request_url, headers, NULL, 0L);
-        if (generic_handler(rd.status_code, rd.response_body)) {
-            printf("rm request finished with status code 204\n");
-            return true;
-        }
+        auto result = std::make_shared<std::promise<bool>>();
+        std::future<bool> future = result->get_future();
+        submit_request("DELETE", request_url, headers, NULL, 0L, [result](response_data &rd, CURLcode res) {
+            bool success = generic_handler(rd.status_code, rd.response_body);
+            if (success) printf("rm request finished with status code 204\n");
+            result->set_value(success);
+        });
+        return future;
+    }
 
-        return false;
+    bool remove_entry(const std::string &entry_id, const std::string &auth_token) {
+        return remove_entry_async(entry_id, auth_token).get();
     }
 
     // Read the contents of a file on the remote system
-    bool read_file(const std::string &file_id, void *buffer, int offset, int size, int &bytes_read, const std::string &auth_token) {
-        CURLcode res;
-        response_data rd;
-        struct curl_slist *chunk = NULL;
-
+    std::future<bool> read_file_async(const std::string &file_id, void *buffer, long long offset, int size, int &bytes_read, const std::string &auth_token, transfer_timing *timing) {
         const std::string request_url = fmt::format("{}sdk/v2/files/{}/content?download=true", request_start, file_id);
         const std::string range_header = fmt::format("Range: bytes={}-{}", offset, offset + size - 1);
 
@@ -514,56 +996,74 @@ namespace bridge {
             range_header
         };
 
-        CURL *curl = request_base("GET", request_url, headers, NULL, 0, rd, chunk);
-        if (curl) {
-            buffer_result current_result(0, (char*)buffer);
-            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, collect_response_bytes);
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &current_result);
-            res = curl_easy_perform(curl);
-            request_free(curl, chunk, res);
+        auto result = std::make_shared<std::promise<bool>>();
+        std::future<bool> future = result->get_future();
+        buffer_result current_result(0, (char*)buffer, size);
+        submit_request("GET", request_url, headers, NULL, 0, [result, &bytes_read, timing](response_data &rd, CURLcode res) {
+            if (timing != NULL) *timing = rd.timing;
             if (rd.status_code == 416) {
                 // Requested range is wrong
                 bytes_read = 0;
                 printf("read request was for an empty file\n");
-                return true;
-            } else if (generic_handler(rd.status_code, rd.response_body)) {
-                bytes_read = current_result.bytes_read;
+                result->set_value(true);
+            } else if (res == CURLE_OK && generic_handler(rd.status_code, rd.response_body)) {
+                bytes_read = rd.bytes_received;
                 printf("read request finished with status code 206\n");
-                return true;
+                result->set_value(true);
+            } else {
+                result->set_value(false);
             }
-        }
-        return false;
+        }, &current_result);
+        return future;
+    }
+
+    bool read_file(const std::string &file_id, void *buffer, long long offset, int size, int &bytes_read, const std::string &auth_token) {
+        return read_file_async(file_id, buffer, offset, size, bytes_read, auth_token).get();
     }
 
     // Get the size of a file on the remote system
-    request_result get_file_size(const std::string &file_id, int &file_size, const std::string &auth_token) {
+    std::future<request_result> get_file_size_async(const std::string &file_id, long long &file_size, const std::string &auth_token, std::string *file_etag) {
         const std::string request_url = fmt::format("{}sdk/v2/files/{}?pretty=false&fields=size", request_start, file_id);
 
         std::vector<std::string> headers {
             auth_token
         };
 
-        if (etag_mapping.find(request_url) != etag_mapping.end()) {
+        std::string etag;
+        if (get_etag(request_url, etag)) {
             // We have a previous ETag, add if-none-match to the headers
-            headers.emplace_back("If-None-Match: " + etag_mapping[request_url]);
+            headers.emplace_back("If-None-Match: " + etag);
         }
 
-        response_data rd = make_request("GET", request_url, headers, NULL, 0L);
-        if (rd.status_code == 304) {
-            return REQUEST_CACHED;
-        } else if (generic_handler(rd.status_code, rd.response_body)) {
-            // Update ETag mapping
-            if (rd.headers.find("etag") != rd.headers.end()) {
-                etag_mapping[request_url] = rd.headers["etag"];
+        auto result = std::make_shared<std::promise<request_result>>();
+        std::future<request_result> future = result->get_future();
+        submit_request("GET", request_url, headers, NULL, 0L, [result, request_url, &file_size, file_etag](response_data &rd, CURLcode res) {
+            if (rd.status_code == 304) {
+                result->set_value(REQUEST_CACHED);
+            } else if (generic_handler(rd.status_code, rd.response_body)) {
+                // Update ETag mapping
+                update_etag(request_url, rd);
+                if (file_etag != NULL && rd.headers.find("etag") != rd.headers.end()) *file_etag = rd.headers["etag"];
+                printf("get_size request finished with status code 200\n");
+                // Runs on the network thread, a malformed body must fail the request instead of throwing
+                try {
+                    auto json_response = json::parse(rd.response_body);
+                    long long size = json_response["size"];
+                    file_size = size;
+                    result->set_value(REQUEST_SUCCESS);
+                } catch (const json::exception &e) {
+                    fprintf(stderr, "[get_size]: Invalid response: %s\n", e.what());
+                    result->set_value(REQUEST_FAILED);
+                }
+            } else {
+                result->set_value(REQUEST_FAILED);
             }
-            printf("get_size request finished with status code 200\n");
-            auto json_response = json::parse(rd.response_body);
-            int size = json_response["size"];
-            file_size = size;
-            return REQUEST_SUCCESS;
-        }
+        });
+        return future;
+    }
 
-        return REQUEST_FAILED;
+    request_result get_file_size(const std::string &file_id, long long &file_size, const std::string &auth_token, std::string *file_etag) {
+        return get_file_size_async(file_id, file_size, auth_token, file_etag).get();
     }
 
     // Close an open file on the remote system
@@ -617,23 +1117,78 @@ namespace bridge {
         return false;
     }
 
-    // Write bytes to a file on the remote system
-    bool write_file(const std::string &auth_token, const std::string &file_location, int offset, int size, const char *buffer) {
-        const std::string request_url = fmt::format("{}{}/resumable/content?offset={}&done=false", request_start, file_location, offset);
+    // Create a file with its whole content in a single request, the metadata and the content are parts of the same body
+    bool upload_file(const std::string &parent_id, const std::string &file_name, const char *content, long long size, time_t modification_time, const std::string &auth_token, std::string &new_file_id) {
+        const std::string request_url = fmt::format("{}sdk/v2/files?resolveNameConflict=0", request_start);
 
         std::vector<std::string> headers {
-            auth_token
+            auth_token,
+            "Content-Type: multipart/related; boundary=287032381131322"
         };
 
-        response_data rd = make_request("PUT", request_url, headers, buffer, (long) size);
-        if (generic_handler(rd.status_code, rd.response_body)) {
-            printf("write_file request finished with status code 204\n");
+        // Write request body
+        std::string modified = modification_time != 0 ? to_iso_time(modification_time) : get_formatted_time();
+        json req = {
+            {"name", file_name},
+            {"parentID", parent_id},
+            {"mTime", modified},
+        };
+
+        std::string request_body = fmt::format("--287032381131322\r\nContent-Type: application/json; charset=UTF-8\r\n\r\n{}\r\n--287032381131322\r\nContent-Type: application/octet-stream\r\n\r\n", req.dump());
+        request_body.append(content, size);
+        request_body.append("\r\n--287032381131322--");
+
+        response_data rd = make_request("POST", request_url, headers, request_body.data(), (long)request_body.size());
+        if (generic_handler(rd.status_code, rd.response_body) && rd.headers.find("location") != rd.headers.end()) {
+            std::string location_header = rd.headers["location"];
+            new_file_id = location_header.substr(location_header.find_last_of('/') + 1);
             return true;
         }
 
         return false;
     }
 
+    // Write bytes to a file on the remote system
+    std::future<bool> write_file_async(const std::string &auth_token, const std::string &file_location, long long offset, int size, const char *buffer) {
+        const std::string request_url = fmt::format("{}{}/resumable/content?offset={}&done=false", request_start, file_location, offset);
+
+        std::vector<std::string> headers {
+            auth_token
+        };
+
+        auto result = std::make_shared<std::promise<bool>>();
+        std::future<bool> future = result->get_future();
+        submit_request("PUT", request_url, headers, buffer, (long) size, [result](response_data &rd, CURLcode res) {
+            bool success = generic_handler(rd.status_code, rd.response_body);
+            if (success) printf("write_file request finished with status code 204\n");
+            result->set_value(success);
+        });
+        return future;
+    }
+
+    bool write_file(const std::string &auth_token, const std::string &file_location, long long offset, int size, const char *buffer) {
+        return write_file_async(auth_token, file_location, offset, size, buffer).get();
+    }
+
+    // Write bytes read from a file descriptor to a file on the remote system, the body is streamed from fd
+    std::future<bool> write_file_from_fd_async(const std::string &auth_token, const std::string &file_location, long long offset, long long size, int fd, long long fd_offset) {
+        const std::string request_url = fmt::format("{}{}/resumable/content?offset={}&done=false", request_start, file_location, offset);
+
+        std::vector<std::string> headers {
+            auth_token
+        };
+
+        upload_source source { fd, fd_offset, size };
+        auto result = std::make_shared<std::promise<bool>>();
+        std::future<bool> future = result->get_future();
+        submit_request("PUT", request_url, headers, NULL, 0L, [result](response_data &rd, CURLcode res) {
+            bool success = generic_handler(rd.status_code, rd.response_body);
+            if (success) printf("write_file request finished with status code 204\n");
+            result->set_value(success);
+        }, NULL, 0L, &source);
+        return future;
+    }
+
     // Rename a file on the remote system
     bool rename_entry(const std::string &entry_id, const std::string &new_name, const std::string &auth_token) {
         const std::string request_url = fmt::format("{}sdk/v2/files/{}/patch", request_start, entry_id);
@@ -1,19 +1,33 @@
+#ifndef __BRIDGE_HPP_
+#define __BRIDGE_HPP_
+
+#include <time.h>
 #include <vector>
 #include <string>
 #include <string_view>
+#include <future>
 
 namespace bridge {
     struct entry_data {
-        int size;
+        long long size = 0;
         std::string id;
         std::string name;
         std::string parent_id;
-        bool is_dir;
+        bool is_dir = false;
+        // Seconds since the epoch the entry was last modified and changed on the remote, 0 if unknown
+        time_t modification_time = 0;
+        time_t change_time = 0;
         entry_data() {}
-        entry_data(int s, bool dir, std::string _id, std::string _name) : size(s), is_dir(dir), id(_id), name(_name) {}
+        entry_data(long long s, bool dir, std::string _id, std::string _name) : size(s), is_dir(dir), id(_id), name(_name) {}
         entry_data(bool dir, std::string _id, std::string _name, std::string _parent_id) : is_dir(dir), id(_id), name(_name), parent_id(_parent_id) {}
     };
 
+    // Timings of a finished transfer in microseconds
+    struct transfer_timing {
+        long long first_byte_us = 0;
+        long long total_us = 0;
+    };
+
     enum request_result {
         REQUEST_SUCCESS,
         REQUEST_FAILED,
@@ -25,11 +39,15 @@ namespace bridge {
     request_result list_entries_multiple(const std::string& ids, const std::string &auth_token, std::vector<entry_data> &entries);
     std::string make_dir(const std::string& folder_name, const std::string& parent_id, const std::string &auth_header);
     bool remove_entry(const std::string &entry_id, const std::string &auth_token);
-    bool read_file(const std::string &file_id, void *buffer, int offset, int size, int &bytes_read, const std::string &auth_token);
-    request_result get_file_size(const std::string &file_id, int &file_size, const std::string &auth_token);
+    bool read_file(const std::string &file_id, void *buffer, long long offset, int size, int &bytes_read, const std::string &auth_token);
+    // file_etag receives the ETag of the file on REQUEST_SUCCESS if it's not NULL
+    request_result get_file_size(const std::string &file_id, long long &file_size, const std::string &auth_token, std::string *file_etag = NULL);
     bool file_write_open(const std::string &parent_id, const std::string &file_name, const std::string &auth_token, std::string &new_file_id);
     bool file_write_close(const std::string &new_file_id, const std::string &auth_token);
-    bool write_file(const std::string &auth_token, const std::string &file_location, int offset, int size, const char *buffer);
+    // Create a file holding size bytes of content in a single request, for files small enough to be sent at once
+    // modification_time is the current time if it's 0
+    bool upload_file(const std::string &parent_id, const std::string &file_name, const char *content, long long size, time_t modification_time, const std::string &auth_token, std::string &new_file_id);
+    bool write_file(const std::string &auth_token, const std::string &file_location, long long offset, int size, const char *buffer);
     bool rename_entry(const std::string &entry_id, const std::string &new_name, const std::string &auth_token);
     bool move_entry(const std::string &entry_id, const std::string &new_parent_id, const std::string &auth_token);
     bool set_modification_time(const std::string &entry_id, const time_t &new_time, const std::string &auth_token);
@@ -38,4 +56,18 @@ namespace bridge {
     bool auth0_get_userid(const std::string &auth_token, std::string &user_id);
     bool get_user_devices(const std::string &auth_token, const std::string &user_id, std::vector<std::pair<std::string, std::string>> &device_list);
     bool detect_endpoint(const std::string &auth_token, std::string_view wdhost);
+
+    // Asynchronous variants, performed by the network thread
+    // Output parameters and buffers must stay valid until the returned future is ready
+    // Listings are parsed by the thread getting the result of their future
+    std::future<request_result> list_entries_async(const std::string& path, const std::string &auth_token, std::vector<entry_data> &entries);
+    std::future<request_result> list_entries_multiple_async(const std::string& ids, const std::string &auth_token, std::vector<entry_data> &entries);
+    std::future<bool> remove_entry_async(const std::string &entry_id, const std::string &auth_token);
+    std::future<bool> read_file_async(const std::string &file_id, void *buffer, long long offset, int size, int &bytes_read, const std::string &auth_token, transfer_timing *timing = NULL);
+    std::future<request_result> get_file_size_async(const std::string &file_id, long long &file_size, const std::string &auth_token, std::string *file_etag = NULL);
+    std::future<bool> write_file_async(const std::string &auth_token, const std::string &file_location, long long offset, int size, const char *buffer);
+    // fd is read with pread from fd_offset, it must stay open until the returned future is ready
+    std::future<bool> write_file_from_fd_async(const std::string &auth_token, const std::string &file_location, long long offset, long long size, int fd, long long fd_offset);
 }
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef __CONCURRENT_MAP_HPP_
+#define __CONCURRENT_MAP_HPP_
+
+#include "pthread.h"
+#include <string>
+#include <functional>
+#include <unordered_map>
+
+// Hash map from strings safe to use from many threads, keys are spread over shards with a reader/writer lock each,
+// so lookups run in parallel and writers only block the keys of their own shard
+// Values are copied out, no reference into the map outlives a call
+template <typename V>
+class concurrent_map {
+    public:
+        static const int SHARDS = 64;
+
+        concurrent_map() {
+            for (shard &s : shards) pthread_rwlock_init(&s.lock, NULL);
+        }
+        ~concurrent_map() {
+            for (shard &s : shards) pthread_rwlock_destroy(&s.lock);
+        }
+
+        // Copy the value of key to value, returns false if there is none
+        bool get(const std::string &key, V &value) const {
+            shard &s = shard_of(key);
+            pthread_rwlock_rdlock(&s.lock);
+            auto it = s.entries.find(key);
+            bool found = it != s.entries.end();
+            if (found) value = it->second;
+            pthread_rwlock_unlock(&s.lock);
+            return found;
+        }
+        bool contains(const std::string &key) const {
+            shard &s = shard_of(key);
+            pthread_rwlock_rdlock(&s.lock);
+            bool found = s.entries.find(key) != s.entries.end();
+            pthread_rwlock_unlock(&s.lock);
+            return found;
+        }
+        void set(const std::string &key, const V &value) {
+            shard &s = shard_of(key);
+            pthread_rwlock_wrlock(&s.lock);
+            s.entries[key] = value;
+            pthread_rwlock_unlock(&s.lock);
+        }
+        // Run visit on the value of key with its shard locked for reading, returns false without calling it if there is none
+        bool read(const std::string &key, const std::function<void(const V&)> &visit) const {
+            shard &s = shard_of(key);
+            pthread_rwlock_rdlock(&s.lock);
+            auto it = s.entries.find(key);
+            bool found = it != s.entries.end();
+            if (found) visit(it->second);
+            pthread_rwlock_unlock(&s.lock);
+            return found;
+        }
+        // Change the value of key in place with its shard locked, a missing value is default constructed first
+        void update(const std::string &key, const std::function<void(V&)> &apply) {
+            shard &s = shard_of(key);
+            pthread_rwlock_wrlock(&s.lock);
+            apply(s.entries[key]);
+            pthread_rwlock_unlock(&s.lock);
+        }
+        // Change the value of key in place with its shard locked, returns false without calling apply if there is none
+        bool update_existing(const std::string &key, const std::function<void(V&)> &apply) {
+            shard &s = shard_of(key);
+            pthread_rwlock_wrlock(&s.lock);
+            auto it = s.entries.find(key);
+            bool found = it != s.entries.end();
+            if (found) apply(it->second);
+            pthread_rwlock_unlock(&s.lock);
+            return found;
+        }
+        // Returns false if there was no value
+        bool erase(const std::string &key) {
+            shard &s = shard_of(key);
+            pthread_rwlock_wrlock(&s.lock);
+            bool found = s.entries.erase(key) > 0;
+            pthread_rwlock_unlock(&s.lock);
+            return found;
+        }
+        // Copy the value of key to value and remove it, returns false if there was none
+        bool take(const std::string &key, V &value) {
+            shard &s = shard_of(key);
+            pthread_rwlock_wrlock(&s.lock);
+            auto it = s.entries.find(key);
+            bool found = it != s.entries.end();
+            if (found) {
+                value = it->second;
+                s.entries.erase(it);
+            }
+            pthread_rwlock_unlock(&s.lock);
+            return found;
+        }
+
+    private:
+        struct shard {
+            pthread_rwlock_t lock;
+            std::unordered_map<std::string, V> entries;
+        };
+        mutable shard shards[SHARDS];
+
+        shard &shard_of(const std::string &key) const {
+            return shards[std::hash<std::string>()(key) % SHARDS];
+        }
+};
+
+#endif
@@ -0,0 +1,93 @@
+#include "copy_engine.hpp"
+#include "bridge.hpp"
+#include "log.h"
+#include <vector>
+#include <future>
+#include <chrono>
+#include <algorithm>
+
+const int copy_engine::MIN_CHUNK;
+const int copy_engine::MAX_CHUNK;
+
+// A round should take about this long, longer rounds make progress and cancellation sluggish
+const long long TARGET_ROUND_MS = 1000;
+
+copy_engine::copy_engine(const std::string &_auth_header, progress_callback _progress, cancel_callback _cancelled) : auth_header(_auth_header), progress(_progress), cancelled(_cancelled) {}
+
+// Resize chunks so that a round of overlapped download and upload takes about TARGET_ROUND_MS
+void copy_engine::adapt_chunk_size(long long round_ms) {
+    if (round_ms < TARGET_ROUND_MS / 2) chunk_size *= 2;
+    else if (round_ms > TARGET_ROUND_MS * 2) chunk_size /= 2;
+    chunk_size = std::clamp(chunk_size, MIN_CHUNK, MAX_CHUNK);
+}
+
+bool copy_engine::copy(const std::string &source_id, const std::string &target_location, long long size, long long start) {
+    if (size <= start) return true;
+    // One buffer receives the next chunk while the other one is uploaded
+    std::vector<char> downloading, uploading;
+    std::future<bool> download, upload;
+    int download_size = 0, bytes_read = 0;
+    long long download_offset = start, upload_end = start, copied = start;
+    bool success = true;
+
+    auto start_download = [&]() {
+        download_size = (int)std::min((long long)chunk_size, size - download_offset);
+        downloading.resize(download_size);
+        bytes_read = 0;
+        download = bridge::read_file_async(source_id, downloading.data(), download_offset, download_size, bytes_read, auth_header);
+    };
+
+    start_download();
+    auto round_start = std::chrono::steady_clock::now();
+    while (true) {
+        // Wait for the download of chunk N and the upload of chunk N - 1
+        bool downloaded = download.get();
+        if (upload.valid()) {
+            if (!upload.get()) {
+                success = false;
+                break;
+            }
+            copied = upload_end;
+            if (progress) progress(copied, size);
+        }
+        if (!downloaded) {
+            success = false;
+            break;
+        }
+        if (cancelled && cancelled()) {
+            LOG("[copy_engine]: Copy of %s cancelled at %lld/%lld\n", source_id.c_str(), copied, size);
+            success = false;
+            break;
+        }
+        adapt_chunk_size(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - round_start).count());
+
+        int chunk_bytes = bytes_read;
+        long long chunk_offset = download_offset;
+        downloading.swap(uploading);
+        download_offset += chunk_bytes;
+        // A short chunk means the source ended early
+        bool more = chunk_bytes == download_size && download_offset < size;
+
+        // Download of chunk N + 1 overlaps the upload of chunk N
+        round_start = std::chrono::steady_clock::now();
+        if (more) start_download();
+        if (chunk_bytes > 0) {
+            upload = bridge::write_file_async(auth_header, target_location, chunk_offset, chunk_bytes, uploading.data());
+            upload_end = chunk_offset + chunk_bytes;
+        }
+        if (!more) {
+            if (upload.valid()) {
+                success = upload.get();
+                if (success) copied = upload_end;
+                if (success && progress) progress(copied, size);
+            }
+            break;
+        }
+    }
+
+    // Buffers are in use until the transfers finish
+    if (download.valid()) download.wait();
+    if (upload.valid()) upload.wait();
+    LOG("[copy_engine]: Copied %lld/%lld bytes of %s\n", copied, size, source_id.c_str());
+    return success;
+}
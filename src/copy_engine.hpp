@@ -0,0 +1,35 @@
+#ifndef __COPY_ENGINE_HPP_
+#define __COPY_ENGINE_HPP_
+
+#include <string>
+#include <functional>
+
+// Copies remote file content into a resumable remote file
+// Chunks are sized from the measured transfer speed and the download of a chunk overlaps the upload of the previous one
+class copy_engine {
+    public:
+        // Smallest and largest chunk moved by a single request
+        static const int MIN_CHUNK = 1024 * 1024;
+        static const int MAX_CHUNK = 32 * 1024 * 1024;
+
+        // Called after every uploaded chunk with the number of bytes copied so far
+        typedef std::function<void(long long copied, long long total)> progress_callback;
+        // Polled between chunks, the copy stops if it returns true
+        typedef std::function<bool()> cancel_callback;
+
+        copy_engine(const std::string &auth_header, progress_callback progress, cancel_callback cancelled);
+
+        // Copy the bytes of the source file from start up to size into the same range of the file at target_location,
+        // returns false on failure or cancellation
+        bool copy(const std::string &source_id, const std::string &target_location, long long size, long long start = 0);
+
+    private:
+        std::string auth_header;
+        progress_callback progress;
+        cancel_callback cancelled;
+        int chunk_size = MIN_CHUNK;
+
+        void adapt_chunk_size(long long round_ms);
+};
+
+#endif
@@ -0,0 +1,156 @@
+#include "dentry_tree.hpp"
+
+dentry_tree::dentry_tree() {
+    root.id = "root";
+    root.is_dir = true;
+    pthread_rwlock_init(&lock, NULL);
+}
+
+dentry_tree::~dentry_tree() {
+    free_children(&root);
+    pthread_rwlock_destroy(&lock);
+}
+
+void dentry_tree::free_children(node *entry) {
+    for (auto &[name, child] : entry->children) {
+        free_children(child);
+        delete child;
+    }
+    entry->children.clear();
+}
+
+// Split a path into its parent path and its last component
+void dentry_tree::split_last(const std::string &path, std::string &parent, std::string &name) {
+    size_t last_slash = path.find_last_of('/');
+    if (last_slash == std::string::npos) {
+        parent.clear();
+        name = path;
+    } else {
+        parent = path.substr(0, last_slash);
+        name = path.substr(last_slash + 1);
+    }
+}
+
+// Walk the components of path from the root, returns NULL if one is missing unless add_missing is set
+// Called with the lock held, for writing if add_missing is set
+dentry_tree::node *dentry_tree::find(const std::string &path, bool add_missing) {
+    node *current = &root;
+    std::string component;
+    size_t start = 0;
+    while (start < path.size()) {
+        size_t end = path.find('/', start);
+        if (end == std::string::npos) end = path.size();
+        if (end > start) {
+            component.assign(path, start, end - start);
+            auto it = current->children.find(component);
+            if (it != current->children.end()) {
+                current = it->second;
+            } else if (add_missing) {
+                node *child = new node();
+                child->name = component;
+                child->parent = current;
+                current->children[component] = child;
+                current = child;
+            } else {
+                return NULL;
+            }
+        }
+        start = end + 1;
+    }
+    return current;
+}
+
+// Unlink a node from its parent and free it with everything below it, called with the lock held for writing
+void dentry_tree::drop(node *entry) {
+    if (entry == &root) {
+        free_children(entry);
+        return;
+    }
+    entry->parent->children.erase(entry->name);
+    free_children(entry);
+    delete entry;
+}
+
+bool dentry_tree::lookup(const std::string &path, std::string &id, bool &is_dir) {
+    pthread_rwlock_rdlock(&lock);
+    node *entry = find(path, false);
+    bool found = entry != NULL && !entry->id.empty();
+    if (found) {
+        id = entry->id;
+        is_dir = entry->is_dir;
+    }
+    pthread_rwlock_unlock(&lock);
+    return found;
+}
+
+std::string dentry_tree::nearest_directory(const std::string &path, size_t &prefix_length) {
+    pthread_rwlock_rdlock(&lock);
+    node *current = &root;
+    std::string id = root.id;
+    std::string component;
+    prefix_length = 0;
+    size_t start = 0;
+    while (start < path.size()) {
+        size_t end = path.find('/', start);
+        // The path itself isn't an ancestor
+        if (end == std::string::npos) break;
+        if (end > start) {
+            component.assign(path, start, end - start);
+            auto it = current->children.find(component);
+            if (it == current->children.end()) break;
+            current = it->second;
+            if (!current->id.empty() && current->is_dir) {
+                id = current->id;
+                prefix_length = end;
+            }
+        }
+        start = end + 1;
+    }
+    pthread_rwlock_unlock(&lock);
+    return id;
+}
+
+void dentry_tree::insert(const std::string &path, const std::string &id, bool is_dir) {
+    pthread_rwlock_wrlock(&lock);
+    node *entry = find(path, true);
+    if (entry != &root) {
+        // Children of an unresolved ancestor were found through it, they stay
+        if (!entry->id.empty() && (entry->id != id || !is_dir)) free_children(entry);
+        entry->id = id;
+        entry->is_dir = is_dir;
+    }
+    pthread_rwlock_unlock(&lock);
+}
+
+void dentry_tree::remove(const std::string &path) {
+    pthread_rwlock_wrlock(&lock);
+    node *entry = find(path, false);
+    if (entry != NULL) drop(entry);
+    pthread_rwlock_unlock(&lock);
+}
+
+bool dentry_tree::move(const std::string &path, const std::string &new_path) {
+    std::string new_parent_path, new_name;
+    split_last(new_path, new_parent_path, new_name);
+    pthread_rwlock_wrlock(&lock);
+    node *entry = find(path, false);
+    node *replaced = find(new_path, false);
+    bool moved = entry != NULL && entry != &root && !new_name.empty();
+    // An entry can't replace one of its ancestors
+    for (node *ancestor = moved ? entry->parent : NULL; ancestor != NULL && moved; ancestor = ancestor->parent) moved = ancestor != replaced;
+    if (moved) {
+        // A directory can't be moved below itself
+        node *new_parent = find(new_parent_path, true);
+        for (node *ancestor = new_parent; ancestor != NULL && moved; ancestor = ancestor->parent) moved = ancestor != entry;
+        if (moved) {
+            if (replaced != NULL && replaced != entry) drop(replaced);
+            entry->parent->children.erase(entry->name);
+            entry->name = new_name;
+            entry->parent = new_parent;
+            new_parent->children[new_name] = entry;
+        }
+    }
+    if (!moved && replaced != NULL) drop(replaced);
+    pthread_rwlock_unlock(&lock);
+    return moved;
+}
@@ -0,0 +1,48 @@
+#ifndef __DENTRY_TREE_HPP_
+#define __DENTRY_TREE_HPP_
+
+#include "pthread.h"
+#include <string>
+#include <unordered_map>
+
+// Remote IDs of local paths kept as a tree of directory entries, a path is resolved by walking its components
+// Every node only holds its own name, so renaming a directory moves everything below it at once
+class dentry_tree {
+    public:
+        dentry_tree();
+        ~dentry_tree();
+
+        // Get the remote ID of path and whether it's a directory, returns false if the path isn't known
+        bool lookup(const std::string &path, std::string &id, bool &is_dir);
+        // Get the remote ID of the deepest known directory above path, the root if there is none,
+        // its path is the first prefix_length characters of path
+        std::string nearest_directory(const std::string &path, size_t &prefix_length);
+        // Bind path to a remote entry, ancestors that aren't known yet are added without an ID
+        // Entries below the path are forgotten if it's bound to a different entry than before
+        void insert(const std::string &path, const std::string &id, bool is_dir);
+        // Forget path and everything below it
+        void remove(const std::string &path);
+        // Move path and everything below it to new_path, replacing whatever was there,
+        // returns false if path wasn't known, new_path is forgotten then
+        bool move(const std::string &path, const std::string &new_path);
+
+    private:
+        struct node {
+            std::string name;
+            // Remote ID, empty for an ancestor added before it was resolved
+            std::string id;
+            bool is_dir = false;
+            node *parent = NULL;
+            std::unordered_map<std::string, node*> children;
+        };
+
+        node root;
+        pthread_rwlock_t lock;
+
+        node *find(const std::string &path, bool add_missing);
+        void drop(node *entry);
+        static void free_children(node *entry);
+        static void split_last(const std::string &path, std::string &parent, std::string &name);
+};
+
+#endif
@@ -0,0 +1,315 @@
+#include "disk_cache.hpp"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <sstream>
+
+// First line of the index file, changes if the format does
+const std::string INDEX_HEADER = "wdfs-cache 2";
+
+// Subdirectory of the cache directory holding the blocks
+const std::string BLOCKS_DIRECTORY = "blocks";
+
+// Split the name of a block file (<id>.<block>) or of a temporary one (<id>.<block>.tmp<n>)
+// Returns false for names the cache didn't create
+static bool parse_block_name(const std::string &name, std::string &file_id, long long &block, bool &temporary) {
+    size_t dot = name.find('.');
+    if (dot == 0 || dot == std::string::npos) return false;
+    const char *start = name.c_str() + dot + 1;
+    char *end = NULL;
+    block = strtoll(start, &end, 10);
+    if (end == start || *start == '-' || *start == '+') return false;
+    temporary = *end != '\0';
+    if (temporary) {
+        if (strncmp(end, ".tmp", 4) != 0) return false;
+        const char *counter = end + 4;
+        strtoull(counter, &end, 10);
+        if (end == counter || *counter == '-' || *counter == '+' || *end != '\0') return false;
+    }
+    file_id = name.substr(0, dot);
+    return true;
+}
+
+bool make_directories(const std::string &path) {
+    for (size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1)) {
+        std::string part = path.substr(0, slash);
+        if (::mkdir(part.c_str(), 0700) != 0 && errno != EEXIST) return false;
+        if (slash == std::string::npos) return true;
+    }
+}
+
+disk_cache::disk_cache(const std::string &_directory, long long _size_cap) : directory(_directory + "/" + BLOCKS_DIRECTORY), size_cap(_size_cap) {
+    pthread_mutex_init(&lock, NULL);
+}
+
+disk_cache::~disk_cache() {
+    if (usable) save();
+    pthread_mutex_destroy(&lock);
+}
+
+std::string disk_cache::block_path(const block_key &key) const {
+    return directory + "/" + key.file_id + "." + std::to_string(key.block);
+}
+
+std::string disk_cache::index_path() const {
+    return directory + "/index";
+}
+
+// Unlike the index, the marker survives a crash
+std::string disk_cache::marker_path() const {
+    return directory + "/.wdfs-cache";
+}
+
+// Make sure the directory belongs to the cache before anything in it is removed
+bool disk_cache::claim_directory() {
+    struct stat st;
+    if (stat(marker_path().c_str(), &st) == 0) return true;
+
+    DIR *dir = opendir(directory.c_str());
+    if (dir == NULL) return false;
+    bool empty = true;
+    struct dirent *de;
+    while (empty && (de = readdir(dir)) != NULL) {
+        empty = strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0;
+    }
+    closedir(dir);
+    if (!empty) {
+        fprintf(stderr, "Cache directory %s isn't empty and wasn't created by wdfs\n", directory.c_str());
+        return false;
+    }
+
+    std::ofstream marker(marker_path(), std::ios::trunc);
+    marker << INDEX_HEADER << "\n";
+    marker.close();
+    return !marker.fail();
+}
+
+// Register a stored block as the most recently used one
+void disk_cache::add_entry(const block_key &key, long long size) {
+    lru.push_front(entry { key, size });
+    index[key] = lru.begin();
+    file_blocks[key.file_id].insert(key.block);
+    size_used += size;
+}
+
+// Remove a block from the indexes and from the disk
+void disk_cache::remove_entry(std::list<entry>::iterator it) {
+    unlink(block_path(it->key).c_str());
+    size_used -= it->size;
+    auto blocks = file_blocks.find(it->key.file_id);
+    if (blocks != file_blocks.end()) {
+        blocks->second.erase(it->key.block);
+        if (blocks->second.empty()) file_blocks.erase(blocks);
+    }
+    index.erase(it->key);
+    lru.erase(it);
+}
+
+bool disk_cache::load() {
+    if (!make_directories(directory)) {
+        fprintf(stderr, "Failed to create cache directory %s\n", directory.c_str());
+        return false;
+    }
+    if (!claim_directory()) return false;
+
+    std::ifstream index_file(index_path());
+    std::string line;
+    if (index_file && std::getline(index_file, line) && line == INDEX_HEADER) {
+        // Blocks are listed from the least recently used one
+        while (std::getline(index_file, line)) {
+            std::istringstream fields(line);
+            std::string type, file_id;
+            fields >> type >> file_id;
+            if (type == "V") {
+                file_version version;
+                fields >> version.size >> version.etag >> version.modification_time;
+                if (version.etag == "-") version.etag.clear();
+                versions[file_id] = version;
+            } else if (type == "B") {
+                block_key key { file_id, 0 };
+                long long size = 0;
+                fields >> key.block >> size;
+                // Skip blocks whose file is missing or was cut short
+                struct stat st;
+                if (stat(block_path(key).c_str(), &st) != 0 || st.st_size != size) continue;
+                if (index.find(key) == index.end()) add_entry(key, size);
+            }
+        }
+    }
+    index_file.close();
+    // Blocks can't be validated without the version of their file
+    std::vector<std::string> unversioned;
+    for (const auto &[file_id, blocks] : file_blocks) {
+        if (versions.find(file_id) == versions.end()) unversioned.emplace_back(file_id);
+    }
+    for (const std::string &file_id : unversioned) {
+        std::vector<long long> to_remove(file_blocks[file_id].begin(), file_blocks[file_id].end());
+        for (long long block : to_remove) remove_entry(index[block_key { file_id, block }]);
+    }
+    // The index is only written on unmount, a missing index after a crash drops the stored blocks
+    unlink(index_path().c_str());
+
+    // Remove block files the index doesn't know about and temporary ones left by a crash, anything else is left alone
+    DIR *dir = opendir(directory.c_str());
+    if (dir == NULL) return false;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_type != DT_REG && de->d_type != DT_UNKNOWN) continue;
+        std::string name(de->d_name);
+        block_key key;
+        bool temporary = false;
+        if (!parse_block_name(name, key.file_id, key.block, temporary)) continue;
+        if (temporary || index.find(key) == index.end()) unlink((directory + "/" + name).c_str());
+    }
+    closedir(dir);
+
+    // Size cap might be smaller than in the previous mount
+    while (size_used > size_cap && !lru.empty()) remove_entry(std::prev(lru.end()));
+    LOG("[disk_cache]: Loaded %d blocks (%lld bytes) from %s\n", (int)lru.size(), size_used, directory.c_str());
+    usable = true;
+    return true;
+}
+
+// Write the index file, replacing the previous one atomically
+void disk_cache::save() {
+    std::string temp_path = index_path() + ".tmp";
+    std::ofstream index_file(temp_path, std::ios::trunc);
+    if (!index_file) return;
+    pthread_mutex_lock(&lock);
+    index_file << INDEX_HEADER << "\n";
+    for (const auto &[file_id, version] : versions) {
+        if (file_blocks.find(file_id) == file_blocks.end()) continue; // Nothing stored for the file
+        index_file << "V " << file_id << " " << version.size << " " << (version.etag.empty() ? "-" : version.etag) << " " << (long long)version.modification_time << "\n";
+    }
+    for (auto it = lru.rbegin(); it != lru.rend(); ++it) {
+        index_file << "B " << it->key.file_id << " " << it->key.block << " " << it->size << "\n";
+    }
+    pthread_mutex_unlock(&lock);
+    index_file.close();
+    if (index_file.fail() || rename(temp_path.c_str(), index_path().c_str()) != 0) {
+        fprintf(stderr, "Failed to write cache index %s\n", index_path().c_str());
+        unlink(temp_path.c_str());
+    }
+}
+
+int disk_cache::open_block(const std::string &file_id, long long block, long long &size) {
+    if (!usable) return -1;
+    block_key key { file_id, block };
+    pthread_mutex_lock(&lock);
+    auto it = index.find(key);
+    if (it == index.end() || confirmed.find(file_id) == confirmed.end()) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    lru.splice(lru.begin(), lru, it->second);
+    size = it->second->size;
+    // An open file can still be read if the block is evicted meanwhile
+    int fd = ::open(block_path(key).c_str(), O_RDONLY | O_CLOEXEC);
+    pthread_mutex_unlock(&lock);
+    return fd;
+}
+
+block_data disk_cache::lookup(const std::string &file_id, long long block) {
+    long long size = -1;
+    int fd = open_block(file_id, block, size);
+    if (size == -1) return NULL; // Block isn't stored
+
+    block_data data = std::make_shared<std::vector<char>>(size);
+    long long done = 0;
+    while (fd != -1 && done < size) {
+        ssize_t n = ::read(fd, data->data() + done, size - done);
+        if (n <= 0) break;
+        done += n;
+    }
+    if (fd != -1) close(fd);
+    if (done == size) return data;
+
+    // Block file is damaged, forget about it
+    LOG("[disk_cache]: Failed to read block %lld of %s\n", block, file_id.c_str());
+    block_key key { file_id, block };
+    pthread_mutex_lock(&lock);
+    auto it = index.find(key);
+    if (it != index.end()) remove_entry(it->second);
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+void disk_cache::insert(const std::string &file_id, long long block, block_data data) {
+    if (!usable || (long long)data->size() > size_cap) return;
+    block_key key { file_id, block };
+    pthread_mutex_lock(&lock);
+    std::string temp_path = block_path(key) + ".tmp" + std::to_string(temp_counter++);
+    pthread_mutex_unlock(&lock);
+
+    // Write outside the lock, the block only becomes visible once it's complete
+    FILE *f = fopen(temp_path.c_str(), "wb");
+    if (f == NULL) return;
+    bool written = fwrite(data->data(), 1, data->size(), f) == data->size();
+    written = fclose(f) == 0 && written;
+    if (!written) {
+        unlink(temp_path.c_str());
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    if (confirmed.insert(file_id).second) {
+        // Blocks a previous mount stored for the file weren't checked, they can't be mixed with fresh ones
+        auto blocks = file_blocks.find(file_id);
+        std::vector<long long> to_remove;
+        if (blocks != file_blocks.end()) to_remove.assign(blocks->second.begin(), blocks->second.end());
+        for (long long stale : to_remove) remove_entry(index[block_key { file_id, stale }]);
+    }
+    auto it = index.find(key);
+    if (it != index.end()) remove_entry(it->second);
+    while (size_used + (long long)data->size() > size_cap && !lru.empty()) {
+        remove_entry(std::prev(lru.end()));
+    }
+    if (rename(temp_path.c_str(), block_path(key).c_str()) == 0) add_entry(key, data->size());
+    else unlink(temp_path.c_str());
+    pthread_mutex_unlock(&lock);
+}
+
+void disk_cache::invalidate(const std::string &file_id) {
+    pthread_mutex_lock(&lock);
+    auto blocks = file_blocks.find(file_id);
+    if (blocks != file_blocks.end()) {
+        LOG("[disk_cache]: Dropping %d stored blocks of %s\n", (int)blocks->second.size(), file_id.c_str());
+        std::vector<long long> to_remove(blocks->second.begin(), blocks->second.end());
+        for (long long block : to_remove) {
+            remove_entry(index[block_key { file_id, block }]);
+        }
+    }
+    versions.erase(file_id);
+    pthread_mutex_unlock(&lock);
+}
+
+void disk_cache::validate(const std::string &file_id, long long size, const std::string &etag, time_t modification_time) {
+    pthread_mutex_lock(&lock);
+    auto it = versions.find(file_id);
+    bool changed = false;
+    if (it != versions.end()) {
+        bool etag_known = !etag.empty() && !it->second.etag.empty();
+        bool time_known = modification_time != 0 && it->second.modification_time != 0;
+        changed = it->second.size != size || (etag_known && it->second.etag != etag) || (time_known && it->second.modification_time != modification_time);
+        // A file can change without changing its size, blocks of a previous mount are dropped unless something else matched
+        if (confirmed.find(file_id) == confirmed.end() && !etag_known && !time_known) changed = true;
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (changed) invalidate(file_id);
+
+    pthread_mutex_lock(&lock);
+    file_version &version = versions[file_id];
+    version.size = size;
+    if (!etag.empty()) version.etag = etag;
+    if (modification_time != 0) version.modification_time = modification_time;
+    confirmed.insert(file_id);
+    pthread_mutex_unlock(&lock);
+}
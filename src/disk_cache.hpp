@@ -0,0 +1,83 @@
+#ifndef __DISK_CACHE_HPP_
+#define __DISK_CACHE_HPP_
+
+#include "block_cache.hpp"
+#include "pthread.h"
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+
+// Create a directory and its missing parents
+bool make_directories(const std::string &path);
+
+// Cache of file blocks stored under a local directory, kept between mounts
+class disk_cache {
+    public:
+        // Blocks are kept in a subdirectory of directory that the cache owns, it's created if it doesn't exist
+        // size_cap is the maximum number of bytes stored
+        disk_cache(const std::string &directory, long long size_cap);
+        // Writes the index, so the cache can be reused by the next mount
+        ~disk_cache();
+
+        // Load the index of a previous mount, returns false if the directory isn't usable
+        bool load();
+        // Get a block of a file, returns NULL on a miss
+        block_data lookup(const std::string &file_id, long long block);
+        // Open the file of a stored block for reading, returns -1 on a miss, the caller closes the descriptor
+        // size is left unchanged if the block isn't stored
+        int open_block(const std::string &file_id, long long block, long long &size);
+        // Store a block of a file
+        void insert(const std::string &file_id, long long block, block_data data);
+        // Drop every block of a file
+        void invalidate(const std::string &file_id);
+        // Drop the blocks of a file if its size, ETag or modification time changed since the last call,
+        // an empty etag or a modification_time of 0 isn't compared
+        // Blocks stored by a previous mount are only served once a call confirmed the ETag or the modification time
+        void validate(const std::string &file_id, long long size, const std::string &etag, time_t modification_time);
+
+    private:
+        struct block_key {
+            std::string file_id;
+            long long block;
+            bool operator==(const block_key &other) const { return block == other.block && file_id == other.file_id; }
+        };
+        struct block_key_hash {
+            size_t operator()(const block_key &key) const { return std::hash<std::string>()(key.file_id) ^ std::hash<long long>()(key.block); }
+        };
+        struct entry {
+            block_key key;
+            long long size;
+        };
+        // Size, ETag and modification time of a file the stored blocks belong to
+        struct file_version {
+            long long size;
+            std::string etag;
+            time_t modification_time = 0;
+        };
+
+        std::string directory;
+        long long size_cap;
+        long long size_used = 0;
+        bool usable = false;
+        // Unique suffix of temporary block files
+        unsigned long long temp_counter = 0;
+        // Most recently used blocks are at the front
+        std::list<entry> lru;
+        std::unordered_map<block_key, std::list<entry>::iterator, block_key_hash> index;
+        std::unordered_map<std::string, std::unordered_set<long long>> file_blocks;
+        std::unordered_map<std::string, file_version> versions;
+        // Files whose version this mount checked, stored blocks of other files might be stale
+        std::unordered_set<std::string> confirmed;
+        pthread_mutex_t lock;
+
+        std::string block_path(const block_key &key) const;
+        std::string index_path() const;
+        std::string marker_path() const;
+        bool claim_directory();
+        void add_entry(const block_key &key, long long size);
+        void remove_entry(std::list<entry>::iterator it);
+        void save();
+};
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef __LOG_H_
+#define __LOG_H_
+
+#include <stdio.h>
+
+#define DEBUG_LOGGING
+
+#ifdef DEBUG_LOGGING
+    #define LOG(fmt,...) printf(fmt, ##__VA_ARGS__)
+#else
+    #define LOG
+#endif
+
+#endif
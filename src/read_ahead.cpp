@@ -0,0 +1,212 @@
+#include "read_ahead.hpp"
+#include "log.h"
+#include <string.h>
+#include <chrono>
+#include <algorithm>
+
+const int read_ahead::CHUNK_SIZE;
+const int read_ahead::MIN_WINDOW;
+const int read_ahead::MAX_WINDOW;
+
+// Reads this close behind the expected offset still count as sequential,
+// the kernel may reorder concurrent read requests of the same file
+const long long SEQUENTIAL_SLACK = read_ahead::CHUNK_SIZE;
+
+read_ahead::read_ahead(const std::string &_file_id, long long _file_size, const std::string &_auth_header, block_cache *_cache) : file_id(_file_id), auth_header(_auth_header), file_size(_file_size), cache(_cache) {
+    pthread_mutex_init(&lock, NULL);
+}
+
+read_ahead::~read_ahead() {
+    // Transfers still write into the chunk buffers, wait for them before freeing
+    drop_window();
+    reap_retired(true);
+    pthread_mutex_destroy(&lock);
+}
+
+// Check if a read at offset continues the current stream
+bool read_ahead::is_sequential(long long offset) const {
+    if (!window.empty() && offset >= window.front()->offset && offset < window.back()->offset + window.back()->size) return true;
+    return offset <= next_offset + SEQUENTIAL_SLACK && offset + SEQUENTIAL_SLACK >= next_offset;
+}
+
+// Issue ranged GETs until window_chunks chunks are in flight after offset
+void read_ahead::fill_window(long long offset) {
+    long long next = offset - offset % CHUNK_SIZE;
+    if (!window.empty()) next = window.back()->offset + window.back()->size;
+
+    while ((int)window.size() < window_chunks) {
+        if (file_size != -1 && next >= file_size) break; // Nothing left to prefetch
+        chunk *c = new chunk();
+        c->offset = next;
+        c->size = CHUNK_SIZE;
+        if (file_size != -1) c->size = (int)std::min((long long)CHUNK_SIZE, file_size - next);
+        if (cache != NULL) c->data = cache->lookup(file_id, next / CHUNK_SIZE);
+        if (c->data != NULL) {
+            // Cached blocks don't need a request
+            c->bytes_read = (int)c->data->size();
+        } else {
+            c->data = std::make_shared<std::vector<char>>(c->size);
+            c->pending = bridge::read_file_async(file_id, c->data->data(), c->offset, c->size, c->bytes_read, auth_header, &c->timing);
+        }
+        window.push_back(c);
+        next += c->size;
+    }
+}
+
+// Abandon all prefetched chunks
+void read_ahead::drop_window() {
+    for (chunk *c : window) {
+        retired.push_back(c);
+    }
+    window.clear();
+}
+
+// Free retired chunks whose transfers are done
+void read_ahead::reap_retired(bool wait) {
+    auto it = retired.begin();
+    while (it != retired.end()) {
+        chunk *c = *it;
+        // An invalid future means the result was already collected
+        bool done = !c->pending.valid();
+        if (!done && wait) c->pending.wait();
+        if (done || c->pending.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+            delete c;
+            it = retired.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// Wait for a chunk to arrive, returns false if the transfer failed
+bool read_ahead::wait_chunk(chunk *c) {
+    if (!c->pending.valid()) return true; // Result was already collected
+    bool stalled = c->pending.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+    bool success = c->pending.get();
+    if (success) {
+        adapt_window(c, stalled);
+        c->data->resize(c->bytes_read);
+        if (cache != NULL) cache->insert(file_id, c->offset / CHUNK_SIZE, c->data);
+    }
+    return success;
+}
+
+// Read bytes without the window, going through the block cache if there's one
+int read_ahead::read_direct(char *buffer, long long offset, int size) {
+    if (cache == NULL) {
+        if (buffer == NULL) return -1;
+        int bytes_read = 0;
+        bool success = bridge::read_file(file_id, buffer, offset, size, bytes_read, auth_header);
+        return success ? bytes_read : -1;
+    }
+
+    // Whole blocks are fetched so later reads of the same region are hits
+    int copied = 0;
+    while (copied < size) {
+        long long position = offset + copied;
+        long long block = position / CHUNK_SIZE;
+        block_data data = cache->lookup(file_id, block);
+        if (data == NULL) {
+            data = std::make_shared<std::vector<char>>(CHUNK_SIZE);
+            int bytes_read = 0;
+            bool success = bridge::read_file(file_id, data->data(), block * CHUNK_SIZE, CHUNK_SIZE, bytes_read, auth_header);
+            if (!success) return copied > 0 ? copied : -1;
+            data->resize(bytes_read);
+            cache->insert(file_id, block, data);
+        }
+
+        int block_offset = (int)(position - block * CHUNK_SIZE);
+        int to_copy = std::min(std::max(0, (int)data->size() - block_offset), size - copied);
+        if (buffer != NULL) memcpy(buffer + copied, data->data() + block_offset, to_copy);
+        copied += to_copy;
+        if ((int)data->size() < CHUNK_SIZE) break; // End of the file
+    }
+    return copied;
+}
+
+// Resize the window from the measured bandwidth-delay product of the link
+void read_ahead::adapt_window(chunk *c, bool stalled) {
+    long long transfer_us = c->timing.total_us - c->timing.first_byte_us;
+    if (c->timing.first_byte_us > 0) {
+        rtt_us = rtt_us == 0 ? c->timing.first_byte_us : 0.8 * rtt_us + 0.2 * c->timing.first_byte_us;
+    }
+    if (transfer_us > 0 && c->bytes_read > 0) {
+        double sample = (double)c->bytes_read / transfer_us;
+        throughput = throughput == 0 ? sample : 0.8 * throughput + 0.2 * sample;
+    }
+
+    // Keep twice the bytes in flight that the link holds during one round trip
+    int bdp_chunks = (int)(2 * throughput * rtt_us / CHUNK_SIZE) + 1;
+    if (stalled) {
+        // Reader had to wait, the window is too small
+        window_chunks = std::max(window_chunks + 1, bdp_chunks);
+    } else {
+        // Reader is ahead of the link, shrink towards the estimate
+        window_chunks = std::min(window_chunks, std::max(bdp_chunks, MIN_WINDOW));
+    }
+    window_chunks = std::clamp(window_chunks, MIN_WINDOW, MAX_WINDOW);
+}
+
+int read_ahead::read(char *buffer, long long offset, int size) {
+    pthread_mutex_lock(&lock);
+    reap_retired(false);
+
+    if (!is_sequential(offset)) {
+        // Random access, stop prefetching until the reader is sequential again
+        LOG("[read_ahead]: Seek to %lld in %s, dropping %d prefetched chunks\n", offset, file_id.c_str(), (int)window.size());
+        drop_window();
+        window_chunks = MIN_WINDOW;
+        next_offset = offset + size;
+        pthread_mutex_unlock(&lock);
+        return read_direct(buffer, offset, size);
+    }
+
+    // Forget chunks the reader has moved past
+    while (!window.empty() && window.front()->offset + window.front()->size <= offset) {
+        retired.push_back(window.front());
+        window.pop_front();
+    }
+    fill_window(offset);
+
+    int copied = 0;
+    bool eof = false;
+    bool failed = false;
+    for (chunk *c : window) {
+        if (copied == size || eof) break;
+        long long position = offset + copied;
+        if (c->offset + c->size <= position) continue;
+        if (c->offset > position) break; // Not covered by the window, read directly below
+        if (!wait_chunk(c)) {
+            failed = true;
+            break;
+        }
+
+        int chunk_offset = (int)(position - c->offset);
+        int available = std::max(0, c->bytes_read - chunk_offset);
+        int to_copy = std::min(available, size - copied);
+        if (buffer != NULL) memcpy(buffer + copied, c->data->data() + chunk_offset, to_copy);
+        copied += to_copy;
+        // A short chunk marks the end of the file, stop prefetching past it
+        if (c->bytes_read < c->size) file_size = c->offset + c->bytes_read;
+        eof = file_size != -1 && c->offset + c->bytes_read >= file_size;
+    }
+    // Prefetching failed, the rest is read directly and the window is rebuilt
+    if (failed) drop_window();
+
+    if (copied < size && !eof) {
+        // Part of the request isn't covered by the window
+        int bytes_read = read_direct(buffer != NULL ? buffer + copied : NULL, offset + copied, size - copied);
+        if (bytes_read < 0) {
+            drop_window();
+            pthread_mutex_unlock(&lock);
+            return copied > 0 ? copied : -1;
+        }
+        copied += bytes_read;
+    }
+
+    next_offset = offset + copied;
+    // Keep the window ahead of the reader
+    fill_window(next_offset);
+    pthread_mutex_unlock(&lock);
+    return copied;
+}
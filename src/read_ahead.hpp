@@ -0,0 +1,68 @@
+#ifndef __READ_AHEAD_HPP_
+#define __READ_AHEAD_HPP_
+
+#include "bridge.hpp"
+#include "block_cache.hpp"
+#include "pthread.h"
+#include <string>
+#include <vector>
+#include <deque>
+#include <future>
+
+// Prefetches the content of an open file ahead of a sequential reader
+class read_ahead {
+    public:
+        // Size of a single ranged GET, chunks are the blocks of the block cache
+        static const int CHUNK_SIZE = block_cache::BLOCK_SIZE;
+        // Bounds of the number of chunks kept in flight
+        static const int MIN_WINDOW = 2;
+        static const int MAX_WINDOW = 64;
+
+        // file_size is -1 if the size of the file isn't known, cache may be NULL
+        read_ahead(const std::string &file_id, long long file_size, const std::string &auth_header, block_cache *cache);
+        ~read_ahead();
+
+        // Read bytes of the file into buffer, returns the number of bytes read or -1 on failure
+        // If buffer is NULL the bytes are only brought into the block cache, which there must be then
+        int read(char *buffer, long long offset, int size);
+
+    private:
+        // A ranged GET issued ahead of the reader
+        struct chunk {
+            long long offset;
+            int size;
+            block_data data;
+            int bytes_read = 0;
+            bridge::transfer_timing timing;
+            std::future<bool> pending;
+        };
+
+        std::string file_id;
+        std::string auth_header;
+        long long file_size;
+        block_cache *cache;
+
+        // Prefetched chunks in file order
+        std::deque<chunk*> window;
+        // Chunks dropped after a seek, freed once their transfer finishes
+        std::vector<chunk*> retired;
+        // Offset the next sequential read is expected at
+        long long next_offset = 0;
+        // Number of chunks to keep in flight
+        int window_chunks = MIN_WINDOW;
+        // Smoothed time to first byte in microseconds and throughput in bytes per microsecond
+        double rtt_us = 0;
+        double throughput = 0;
+
+        pthread_mutex_t lock;
+
+        bool is_sequential(long long offset) const;
+        void fill_window(long long offset);
+        void drop_window();
+        void reap_retired(bool wait);
+        bool wait_chunk(chunk *c);
+        void adapt_window(chunk *c, bool stalled);
+        int read_direct(char *buffer, long long offset, int size);
+};
+
+#endif
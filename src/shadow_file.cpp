@@ -0,0 +1,242 @@
+#include "shadow_file.hpp"
+#include "bridge.hpp"
+#include "log.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <deque>
+#include <future>
+
+const int shadow_file::BLOCK_SIZE;
+
+// Number of blocks fetched from the remote at the same time
+const int FILL_PARALLEL = 8;
+
+shadow_file::shadow_file(const std::string &_path, const std::string &_remote_id, long long _remote_size, const std::string &_auth_header, block_cache *_cache) : path(_path), remote_id(_remote_id), auth_header(_auth_header), cache(_cache), remote_size(std::max(0LL, _remote_size)), file_size(std::max(0LL, _remote_size)) {
+    local.resize((remote_size + BLOCK_SIZE - 1) / BLOCK_SIZE, false);
+    pthread_mutex_init(&lock, NULL);
+}
+
+shadow_file::~shadow_file() {
+    if (local_fd != -1) {
+        close(local_fd);
+        if (!kept) unlink(path.c_str());
+    }
+    pthread_mutex_destroy(&lock);
+}
+
+bool shadow_file::create() {
+    local_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (local_fd == -1) {
+        LOG("[shadow_file]: Failed to create %s: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    // Blocks that are never touched take no space
+    if (ftruncate(local_fd, file_size) != 0) {
+        LOG("[shadow_file]: Failed to resize %s: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool shadow_file::open_existing(long long size) {
+    local_fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (local_fd == -1) return false;
+    struct stat st;
+    if (fstat(local_fd, &st) != 0 || st.st_size != size) {
+        close(local_fd);
+        local_fd = -1;
+        return false;
+    }
+    // Every byte is local already
+    remote_size = 0;
+    local.clear();
+    file_size = size;
+    return true;
+}
+
+long long shadow_file::size() {
+    pthread_mutex_lock(&lock);
+    long long result = file_size;
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+// Check if a block has no remote content left to fetch, called with the lock held
+bool shadow_file::is_local(long long block) const {
+    return block * BLOCK_SIZE >= remote_size || local[block];
+}
+
+// Write the remote content of a block to the local file unless it has been made local meanwhile, called with the lock held
+void shadow_file::store_block(long long block, const std::vector<char> &data, int size) {
+    if (is_local(block)) return;
+    // The file might have been truncated since the fetch started
+    long long count = std::min((long long)size, remote_size - block * BLOCK_SIZE);
+    long long written = 0;
+    while (written < count) {
+        ssize_t res = pwrite(local_fd, data.data() + written, count - written, block * BLOCK_SIZE + written);
+        if (res <= 0) return;
+        written += res;
+    }
+    local[block] = true;
+}
+
+bool shadow_file::fill(long long offset, long long size) {
+    if (size <= 0) return true;
+    std::vector<long long> missing;
+    pthread_mutex_lock(&lock);
+    long long last = std::min(offset + size, remote_size);
+    for (long long block = offset / BLOCK_SIZE; block * BLOCK_SIZE < last; block++) {
+        if (!is_local(block)) missing.push_back(block);
+    }
+    pthread_mutex_unlock(&lock);
+    if (missing.empty()) return true;
+
+    // Blocks are fetched without the lock held, a write to a block meanwhile makes the fetched content obsolete
+    struct fetch {
+        long long block;
+        std::vector<char> data;
+        int bytes_read = 0;
+        std::future<bool> result;
+    };
+    std::deque<fetch*> in_flight;
+    bool success = true;
+    auto finish_oldest = [&]() {
+        fetch *f = in_flight.front();
+        in_flight.pop_front();
+        if (f->result.get()) {
+            f->data.resize(f->bytes_read);
+            if (cache != NULL) cache->insert(remote_id, f->block, std::make_shared<std::vector<char>>(f->data));
+            pthread_mutex_lock(&lock);
+            store_block(f->block, f->data, f->bytes_read);
+            pthread_mutex_unlock(&lock);
+        } else {
+            LOG("[shadow_file]: Failed to fetch block %lld of %s\n", f->block, remote_id.c_str());
+            success = false;
+        }
+        delete f;
+    };
+    for (long long block : missing) {
+        block_data data = cache != NULL ? cache->lookup(remote_id, block) : NULL;
+        if (data != NULL) {
+            pthread_mutex_lock(&lock);
+            store_block(block, *data, (int)data->size());
+            pthread_mutex_unlock(&lock);
+            continue;
+        }
+        if ((int)in_flight.size() == FILL_PARALLEL) finish_oldest();
+        fetch *f = new fetch();
+        f->block = block;
+        f->data.resize(BLOCK_SIZE);
+        f->result = bridge::read_file_async(remote_id, f->data.data(), block * BLOCK_SIZE, BLOCK_SIZE, f->bytes_read, auth_header);
+        in_flight.push_back(f);
+    }
+    while (!in_flight.empty()) finish_oldest();
+    return success;
+}
+
+int shadow_file::read(char *buffer, long long offset, int size) {
+    long long available = std::max(0LL, std::min((long long)size, this->size() - offset));
+    if (!fill(offset, available)) return -1;
+    long long done = 0;
+    while (done < available) {
+        ssize_t res = pread(local_fd, buffer + done, available - done, offset + done);
+        if (res < 0) return -1;
+        if (res == 0) break;
+        done += res;
+    }
+    return (int)done;
+}
+
+bool shadow_file::write_buf(struct fuse_bufvec *buf, long long offset) {
+    long long size = fuse_buf_size(buf);
+    if (size == 0) return true;
+    long long first = offset / BLOCK_SIZE;
+    long long last = (offset + size - 1) / BLOCK_SIZE;
+
+    // Blocks in the middle are overwritten completely, only the edges might need their remote content
+    pthread_mutex_lock(&lock);
+    std::vector<long long> partial;
+    for (long long block : { first, last }) {
+        long long remote_end = std::min((block + 1) * BLOCK_SIZE, remote_size);
+        bool covered = offset <= block * BLOCK_SIZE && offset + size >= remote_end;
+        if (!is_local(block) && !covered && (partial.empty() || partial.back() != block)) partial.push_back(block);
+    }
+    pthread_mutex_unlock(&lock);
+    for (long long block : partial) {
+        if (!fill(block * BLOCK_SIZE, 1)) return false;
+    }
+
+    pthread_mutex_lock(&lock);
+    for (long long block = first; block <= last && block * BLOCK_SIZE < remote_size; block++) {
+        // Remote content of the block is either local already or replaced by this write
+        local[block] = true;
+    }
+    long long copied = 0;
+    bool success = true;
+    while (copied < size) {
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT((size_t)(size - copied));
+        dst.buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+        dst.buf[0].fd = local_fd;
+        dst.buf[0].pos = offset + copied;
+        // Source position is advanced by the copy
+        ssize_t res = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_MOVE);
+        if (res <= 0) {
+            LOG("[shadow_file]: Failed to write %lld bytes at %lld to %s\n", size - copied, offset + copied, path.c_str());
+            success = false;
+            break;
+        }
+        copied += res;
+    }
+    file_size = std::max(file_size, offset + copied);
+    pthread_mutex_unlock(&lock);
+    return success;
+}
+
+bool shadow_file::truncate(long long size) {
+    pthread_mutex_lock(&lock);
+    bool success = ftruncate(local_fd, size) == 0;
+    if (success) {
+        // Remote bytes past the new end are gone, the file is extended with zeros
+        remote_size = std::min(remote_size, size);
+        file_size = size;
+    }
+    pthread_mutex_unlock(&lock);
+    return success;
+}
+
+bool shadow_file::sync() {
+    return fsync(local_fd) == 0;
+}
+
+bool shadow_file::upload(const std::string &file_location, int chunk_size, long long in_flight_budget, long long start, ack_callback acknowledged) {
+    long long total = size();
+    struct pending_chunk {
+        long long end;
+        long long size;
+        std::future<bool> result;
+    };
+    std::deque<pending_chunk> in_flight;
+    long long in_flight_bytes = 0;
+    bool success = true;
+    auto wait_oldest = [&]() {
+        // Chunks are waited for in order, so everything before the end of a successful chunk is acknowledged
+        bool chunk_success = in_flight.front().result.get();
+        if (chunk_success && success && acknowledged) acknowledged(in_flight.front().end);
+        success = chunk_success && success;
+        in_flight_bytes -= in_flight.front().size;
+        in_flight.pop_front();
+    };
+    for (long long offset = start; offset < total && success; offset += chunk_size) {
+        long long chunk = std::min((long long)chunk_size, total - offset);
+        while (!in_flight.empty() && in_flight_bytes + chunk > in_flight_budget) wait_oldest();
+        in_flight.push_back(pending_chunk { offset + chunk, chunk, bridge::write_file_from_fd_async(auth_header, file_location, offset, chunk, local_fd, offset) });
+        in_flight_bytes += chunk;
+    }
+    while (!in_flight.empty()) wait_oldest();
+    LOG("[shadow_file]: Upload of %lld bytes from %s %s\n", total, path.c_str(), success ? "finished" : "failed");
+    return success;
+}
@@ -0,0 +1,70 @@
+#ifndef __SHADOW_FILE_HPP_
+#define __SHADOW_FILE_HPP_
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 35
+#endif
+
+#include "block_cache.hpp"
+#include "pthread.h"
+#include <fuse.h>
+#include <string>
+#include <vector>
+#include <functional>
+
+// Local sparse copy of a remote file written in write-back mode
+// Blocks of the remote content are fetched the first time they are read or partially written
+class shadow_file {
+    public:
+        static const int BLOCK_SIZE = block_cache::BLOCK_SIZE;
+
+        // path is the local file, the shadow starts with the first remote_size bytes of the remote file remote_id
+        shadow_file(const std::string &path, const std::string &remote_id, long long remote_size, const std::string &auth_header, block_cache *cache);
+        // Closes the local file and removes it unless it's kept
+        ~shadow_file();
+
+        // Called with the number of bytes from the start the remote acknowledged
+        typedef std::function<void(long long acked)> ack_callback;
+
+        // Create the local file, returns false if it can't be created
+        bool create();
+        // Open a complete local file left by a previous mount, returns false if it's missing or its size isn't size
+        bool open_existing(long long size);
+        // Leave the local file on the disk when the shadow is destroyed
+        void keep() { kept = true; }
+        const std::string &local_path() const { return path; }
+        // Descriptor of the local file, only ranges passed to fill hold the content of the file
+        int fd() const { return local_fd; }
+        long long size();
+        // Fetch the remote blocks of a range that aren't local yet, returns false if fetching failed
+        bool fill(long long offset, long long size);
+        // Read up to size bytes at offset, returns the number of bytes read or -1 on failure
+        int read(char *buffer, long long offset, int size);
+        // Write the content of a fuse buffer at offset, fd backed buffers are spliced
+        bool write_buf(struct fuse_bufvec *buf, long long offset);
+        bool truncate(long long size);
+        // Write the local file to the disk, fill it first to make it complete
+        bool sync();
+        // Upload the file from start to the resumable remote file at file_location in chunks of chunk_size bytes,
+        // at most in_flight_budget bytes are uploaded at the same time, the file has to be filled before
+        bool upload(const std::string &file_location, int chunk_size, long long in_flight_budget, long long start, ack_callback acknowledged);
+
+    private:
+        std::string path;
+        std::string remote_id;
+        std::string auth_header;
+        block_cache *cache;
+        int local_fd = -1;
+        bool kept = false;
+        // Bytes at the start of the file that come from the remote file where they aren't local yet
+        long long remote_size;
+        long long file_size;
+        // Blocks of the remote range that are local
+        std::vector<bool> local;
+        pthread_mutex_t lock;
+
+        bool is_local(long long block) const;
+        void store_block(long long block, const std::vector<char> &data, int size);
+};
+
+#endif
@@ -0,0 +1,138 @@
+#include "upload_journal.hpp"
+#include "log.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <fstream>
+#include <sstream>
+#include <map>
+
+// First line of the journal, changes if the format does
+const std::string JOURNAL_HEADER = "wdfs-journal 1";
+
+upload_journal::upload_journal(const std::string &_directory) : directory(_directory) {
+    pthread_mutex_init(&lock, NULL);
+}
+
+upload_journal::~upload_journal() {
+    if (journal_fd != -1) close(journal_fd);
+    pthread_mutex_destroy(&lock);
+}
+
+std::string upload_journal::journal_path() const {
+    return directory + "/journal";
+}
+
+// Lines of a record, enough to restore it on its own
+static std::string record_lines(const upload_journal::record &r) {
+    // Created files have no remote file yet
+    std::string remote_id = r.remote_id.empty() ? "-" : r.remote_id;
+    std::string lines = "U " + std::to_string(r.id) + " " + r.shadow_name + " " + remote_id + " " + (r.created ? "1" : "0") + " " + r.parent_id + " " + std::to_string(r.size) + " " + r.path + "\n";
+    if (!r.temp_id.empty()) lines += "T " + std::to_string(r.id) + " " + r.temp_id + "\n";
+    if (r.acked > 0) lines += "A " + std::to_string(r.id) + " " + std::to_string(r.acked) + "\n";
+    if (r.closed) lines += "C " + std::to_string(r.id) + "\n";
+    if (r.replaced) lines += "R " + std::to_string(r.id) + "\n";
+    return lines;
+}
+
+bool upload_journal::load(std::vector<record> &pending) {
+    std::map<unsigned long long, record> records;
+    std::ifstream journal_file(journal_path());
+    std::string line;
+    if (journal_file && std::getline(journal_file, line) && line == JOURNAL_HEADER) {
+        while (std::getline(journal_file, line)) {
+            std::istringstream fields(line);
+            std::string type;
+            unsigned long long id = 0;
+            // A line cut short by a crash is the last one and fails to parse
+            if (!(fields >> type >> id)) continue;
+            if (type == "U") {
+                record r;
+                int created = 0;
+                r.id = id;
+                if (!(fields >> r.shadow_name >> r.remote_id >> created >> r.parent_id >> r.size)) continue;
+                r.created = created != 0;
+                if (r.remote_id == "-") r.remote_id.clear();
+                // Path is the rest of the line, it may contain spaces
+                std::getline(fields, r.path);
+                if (r.path.size() < 2) continue;
+                r.path.erase(0, 1);
+                records[id] = r;
+            }
+            if (id >= next_id) next_id = id + 1;
+            auto it = records.find(id);
+            if (it == records.end()) continue;
+            if (type == "T") fields >> it->second.temp_id;
+            else if (type == "A") fields >> it->second.acked;
+            else if (type == "C") it->second.closed = true;
+            else if (type == "R") it->second.replaced = true;
+            else if (type == "D") records.erase(it);
+        }
+    }
+    journal_file.close();
+
+    // Start over with the unfinished uploads only, the old journal is replaced atomically
+    std::string temp_path = journal_path() + ".tmp";
+    int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        fprintf(stderr, "Failed to write upload journal %s: %s\n", temp_path.c_str(), strerror(errno));
+        return false;
+    }
+    std::string content = JOURNAL_HEADER + "\n";
+    for (const auto &[id, r] : records) {
+        content += record_lines(r);
+        pending.push_back(r);
+    }
+    bool written = write(fd, content.data(), content.size()) == (ssize_t)content.size() && fdatasync(fd) == 0;
+    close(fd);
+    if (!written || rename(temp_path.c_str(), journal_path().c_str()) != 0) {
+        fprintf(stderr, "Failed to write upload journal %s\n", journal_path().c_str());
+        unlink(temp_path.c_str());
+        return false;
+    }
+    journal_fd = ::open(journal_path().c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    LOG("[upload_journal]: %d unfinished uploads in %s\n", (int)pending.size(), journal_path().c_str());
+    return journal_fd != -1;
+}
+
+// Add a line to the journal, it's on the disk once this returns
+void upload_journal::append(const std::string &line) {
+    pthread_mutex_lock(&lock);
+    if (journal_fd != -1) {
+        if (write(journal_fd, line.data(), line.size()) != (ssize_t)line.size() || fdatasync(journal_fd) != 0) {
+            LOG("[upload_journal]: Failed to append to %s: %s\n", journal_path().c_str(), strerror(errno));
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+unsigned long long upload_journal::begin(const record &upload) {
+    pthread_mutex_lock(&lock);
+    record r = upload;
+    r.id = next_id++;
+    pthread_mutex_unlock(&lock);
+    append(record_lines(r));
+    return r.id;
+}
+
+void upload_journal::temp_opened(unsigned long long id, const std::string &temp_id) {
+    append("T " + std::to_string(id) + " " + temp_id + "\n");
+}
+
+void upload_journal::acknowledged(unsigned long long id, long long offset) {
+    append("A " + std::to_string(id) + " " + std::to_string(offset) + "\n");
+}
+
+void upload_journal::closed(unsigned long long id) {
+    append("C " + std::to_string(id) + "\n");
+}
+
+void upload_journal::replaced(unsigned long long id) {
+    append("R " + std::to_string(id) + "\n");
+}
+
+void upload_journal::finished(unsigned long long id) {
+    append("D " + std::to_string(id) + "\n");
+}
@@ -0,0 +1,57 @@
+#ifndef __UPLOAD_JOURNAL_HPP_
+#define __UPLOAD_JOURNAL_HPP_
+
+#include "pthread.h"
+#include <string>
+#include <vector>
+
+// Append-only log of the uploads of shadow files, uploads interrupted by a crash or an unmount resume on the next mount
+class upload_journal {
+    public:
+        // State of an upload that hasn't finished
+        struct record {
+            unsigned long long id = 0;
+            // Name of the shadow file in the directory of the journal and the local path it belongs to
+            std::string shadow_name;
+            std::string path;
+            // Remote file the upload replaces, empty for a created file
+            std::string remote_id;
+            bool created = false;
+            std::string parent_id;
+            long long size = 0;
+            // Resumable remote file the content is uploaded to, empty until it's opened
+            std::string temp_id;
+            // Bytes from the start acknowledged by the remote
+            long long acked = 0;
+            bool closed = false;
+            // Original remote file has been removed
+            bool replaced = false;
+        };
+
+        // The journal is kept in directory
+        upload_journal(const std::string &directory);
+        ~upload_journal();
+
+        // Read the uploads a previous mount didn't finish and start a new journal holding only them,
+        // returns false if the journal can't be written
+        bool load(std::vector<record> &pending);
+        // Record a new upload, returns its ID
+        unsigned long long begin(const record &upload);
+        void temp_opened(unsigned long long id, const std::string &temp_id);
+        void acknowledged(unsigned long long id, long long offset);
+        void closed(unsigned long long id);
+        void replaced(unsigned long long id);
+        // Upload is done or abandoned, nothing is resumed for it
+        void finished(unsigned long long id);
+
+    private:
+        std::string directory;
+        int journal_fd = -1;
+        unsigned long long next_id = 1;
+        pthread_mutex_t lock;
+
+        std::string journal_path() const;
+        void append(const std::string &line);
+};
+
+#endif
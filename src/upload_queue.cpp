@@ -0,0 +1,51 @@
+#include "upload_queue.hpp"
+#include <stdio.h>
+
+upload_queue::upload_queue(int worker_count) {
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&changed, NULL);
+    for (int i = 0; i < worker_count; i++) {
+        pthread_t worker;
+        if (pthread_create(&worker, NULL, run, this) != 0) break;
+        workers.push_back(worker);
+    }
+    if (workers.empty()) fprintf(stderr, "[upload_queue]: Failed to start the upload threads, uploads run in the foreground\n");
+}
+
+upload_queue::~upload_queue() {
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+    for (pthread_t worker : workers) pthread_join(worker, NULL);
+    pthread_cond_destroy(&changed);
+    pthread_mutex_destroy(&lock);
+}
+
+void upload_queue::push(job upload) {
+    if (workers.empty()) {
+        upload();
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    jobs.push_back(upload);
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+}
+
+void *upload_queue::run(void *arg) {
+    upload_queue *queue = (upload_queue*) arg;
+    pthread_mutex_lock(&queue->lock);
+    while (true) {
+        while (queue->jobs.empty() && !queue->stopping) pthread_cond_wait(&queue->changed, &queue->lock);
+        // Queued uploads are finished before stopping
+        if (queue->jobs.empty()) break;
+        job upload = queue->jobs.front();
+        queue->jobs.pop_front();
+        pthread_mutex_unlock(&queue->lock);
+        upload();
+        pthread_mutex_lock(&queue->lock);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
@@ -0,0 +1,33 @@
+#ifndef __UPLOAD_QUEUE_HPP_
+#define __UPLOAD_QUEUE_HPP_
+
+#include "pthread.h"
+#include <deque>
+#include <vector>
+#include <functional>
+
+// Runs uploads of released files on background threads, jobs are started in the order they were queued
+class upload_queue {
+    public:
+        typedef std::function<void()> job;
+
+        // Up to workers jobs run at the same time, the worker threads are started by the constructor,
+        // create the queue after fuse daemonized
+        upload_queue(int workers);
+        // Runs the jobs still queued before returning
+        ~upload_queue();
+
+        void push(job upload);
+
+    private:
+        std::deque<job> jobs;
+        bool stopping = false;
+        // Jobs run on the calling thread if no worker could be started
+        std::vector<pthread_t> workers;
+        pthread_mutex_t lock;
+        pthread_cond_t changed;
+
+        static void *run(void *queue);
+};
+
+#endif
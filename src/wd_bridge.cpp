@@ -1,8 +1,10 @@
 #include "wdfs.h"
 #include "bridge.hpp"
 #include <stdio.h>
+#include <stdlib.h>
 #include <stddef.h>
 #include <string_view>
+#include <algorithm>
 
 #define WDFS_OPT(t, p, v) { t, offsetof(struct WdFsConfig, p), v }
 
@@ -11,6 +13,22 @@ struct WdFsConfig {
     char* username;
     char* password;
     char* host;
+    int cache_size;
+    char* cache_dir;
+    int disk_cache_size;
+    int write_buffer;
+    int upload_in_flight;
+    int small_file;
+    int upload_workers;
+    int upload_disk;
+    int listing_ttl;
+    int negative_ttl;
+    int entry_timeout;
+    int attr_timeout;
+    int negative_timeout;
+    int exact_nlink;
+    int writeback;
+    char* shadow_dir;
 };
 
 // Configuration for fuse argument parser
@@ -18,6 +36,22 @@ static struct fuse_opt WdFsOpts[] = {
     WDFS_OPT("user=%s", username, 0),
     WDFS_OPT("pass=%s", password, 0),
     WDFS_OPT("host=%s", host, 0),
+    WDFS_OPT("cache_size=%d", cache_size, 0),
+    WDFS_OPT("cache_dir=%s", cache_dir, 0),
+    WDFS_OPT("disk_cache_size=%d", disk_cache_size, 0),
+    WDFS_OPT("write_buffer=%d", write_buffer, 0),
+    WDFS_OPT("upload_in_flight=%d", upload_in_flight, 0),
+    WDFS_OPT("small_file=%d", small_file, 0),
+    WDFS_OPT("upload_workers=%d", upload_workers, 0),
+    WDFS_OPT("upload_disk=%d", upload_disk, 0),
+    WDFS_OPT("listing_ttl=%d", listing_ttl, 0),
+    WDFS_OPT("negative_ttl=%d", negative_ttl, 0),
+    WDFS_OPT("entry_timeout=%d", entry_timeout, 0),
+    WDFS_OPT("attr_timeout=%d", attr_timeout, 0),
+    WDFS_OPT("negative_timeout=%d", negative_timeout, 0),
+    WDFS_OPT("exact_nlink", exact_nlink, 1),
+    WDFS_OPT("writeback", writeback, 1),
+    WDFS_OPT("shadow_dir=%s", shadow_dir, 0),
     FUSE_OPT_END
 };
 
@@ -26,12 +60,24 @@ int main (int argc, char *argv[]) {
     WdFsConfig conf;
 
     memset(&conf, 0, sizeof(conf));
+    conf.cache_size = -1;
+    conf.disk_cache_size = -1;
+    conf.write_buffer = -1;
+    conf.upload_in_flight = -1;
+    conf.small_file = -1;
+    conf.upload_workers = -1;
+    conf.upload_disk = -1;
+    conf.listing_ttl = -1;
+    conf.negative_ttl = -1;
+    conf.entry_timeout = -1;
+    conf.attr_timeout = -1;
+    conf.negative_timeout = -1;
 
     fuse_opt_parse(&args, &conf, WdFsOpts, NULL);
 
     if (conf.username == NULL || conf.password == NULL || conf.host == NULL) {
         fprintf(stderr, "Error: too few arguments given\n");
-        fprintf(stderr, "Usage: wd_bridge [-f] <mount_point> -ouser=<username>,pass=<password>,host=<device_id>\n");
+        fprintf(stderr, "Usage: wd_bridge [-f] <mount_point> -ouser=<username>,pass=<password>,host=<device_id>[,cache_size=<MiB>,cache_dir=<path>,disk_cache_size=<MiB>,write_buffer=<MiB>,upload_in_flight=<MiB>,small_file=<KiB>,upload_workers=<n>,upload_disk=<MiB>,listing_ttl=<s>,negative_ttl=<s>,entry_timeout=<s>,attr_timeout=<s>,negative_timeout=<s>,exact_nlink,writeback,shadow_dir=<path>]\n");
         return 1;
     }
 
@@ -68,8 +114,42 @@ int main (int argc, char *argv[]) {
         return 1;
     }
 
+    // Size of the content cache is given in MiB
+    WdFsOptions options;
+    options.cache_size = (conf.cache_size < 0 ? 256LL : conf.cache_size) * 1024 * 1024;
+    options.disk_cache_size = (conf.disk_cache_size < 0 ? 4096LL : conf.disk_cache_size) * 1024 * 1024;
+    options.write_buffer_size = (conf.write_buffer < 1 ? 16 : std::min(conf.write_buffer, 1024)) * 1024 * 1024;
+    options.upload_in_flight = (conf.upload_in_flight < 1 ? 64LL : conf.upload_in_flight) * 1024 * 1024;
+    // Small file threshold is given in KiB, 0 uploads every file through a resumable upload
+    options.small_file_size = (conf.small_file < 0 ? 1024LL : conf.small_file) * 1024;
+    options.upload_workers = conf.upload_workers < 1 ? 4 : std::min(conf.upload_workers, 64);
+    options.upload_disk = (conf.upload_disk < 1 ? 1024LL : conf.upload_disk) * 1024 * 1024;
+    options.listing_ttl = conf.listing_ttl < 0 ? 1 : conf.listing_ttl;
+    options.negative_ttl = conf.negative_ttl < 0 ? 10 : conf.negative_ttl;
+    options.entry_timeout = conf.entry_timeout < 0 ? 1 : conf.entry_timeout;
+    options.attr_timeout = conf.attr_timeout < 0 ? 1 : conf.attr_timeout;
+    options.negative_timeout = conf.negative_timeout < 0 ? 1 : conf.negative_timeout;
+    if (conf.cache_dir != NULL) {
+        options.cache_dir = conf.cache_dir;
+        free(conf.cache_dir);
+    } else if (getenv("XDG_CACHE_HOME") != NULL) {
+        options.cache_dir = std::string(getenv("XDG_CACHE_HOME")) + "/wdfs/" + conf.host;
+    } else if (getenv("HOME") != NULL) {
+        options.cache_dir = std::string(getenv("HOME")) + "/.cache/wdfs/" + conf.host;
+    }
+    // Shadow files live next to the cached blocks by default
+    options.exact_nlink = conf.exact_nlink != 0;
+    options.writeback = conf.writeback != 0;
+    if (conf.shadow_dir != NULL) {
+        options.shadow_dir = conf.shadow_dir;
+        free(conf.shadow_dir);
+    } else if (!options.cache_dir.empty()) {
+        options.shadow_dir = options.cache_dir + "/shadow";
+    }
+
     WdFs fs;
     fs.set_authorization_header(authorization_header);
+    fs.set_options(options);
 
     int result = fs.run(args.argc, args.argv);
     bridge::release_bridge();
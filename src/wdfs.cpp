@@ -1,59 +1,254 @@
 #include "wdfs.h"
 #include "bridge.hpp"
+#include "read_ahead.hpp"
+#include "block_cache.hpp"
+#include "disk_cache.hpp"
+#include "write_buffer.hpp"
+#include "copy_engine.hpp"
+#include "shadow_file.hpp"
+#include "upload_queue.hpp"
+#include "upload_journal.hpp"
+#include "concurrent_map.hpp"
+#include "dentry_tree.hpp"
+#include "log.h"
 #include "../include/Fuse-impl.h"
 #include <stdio.h>
 #include <unistd.h>
+#include <dirent.h>
 #include <time.h>
+#include <string.h>
 #include <string>
 #include <vector>
 #include <unordered_map>
-
-#define DEBUG_LOGGING
-
-#ifdef DEBUG_LOGGING
-    #define LOG(fmt,...) printf(fmt, ##__VA_ARGS__)
-#else
-    #define LOG
-#endif
-
-// Value used for remote ID and local path mapping
-struct id_cache_value {
-    std::string id;
-    bool is_dir;
-    id_cache_value() {}
-    id_cache_value(std::string _id, bool _is_dir) : id(_id), is_dir(_is_dir) {}
-};
+#include <unordered_set>
+#include <deque>
+#include <algorithm>
+#include <functional>
+#include <atomic>
 
 // Value used for subfolder count caching
 struct subfolder_cache_value {
     int is_hot;
     int subfolder_count;
-    subfolder_cache_value() {}
+    subfolder_cache_value() : is_hot(0), subfolder_count(0) {}
     subfolder_cache_value(int h, int c) : is_hot(h), subfolder_count(c) {}
 };
 
 // Value used for file size caching
 struct filesize_cache_value {
     int is_hot;
-    int filesize;
-    filesize_cache_value() {}
-    filesize_cache_value(int h, int s) : is_hot(h), filesize(s) {}
+    long long filesize;
+    filesize_cache_value() : is_hot(0), filesize(0) {}
+    filesize_cache_value(int h, long long s) : is_hot(h), filesize(s) {}
+};
+
+// Value used for caching the entries of a folder
+struct listing_cache_value {
+    std::vector<bridge::entry_data> entries;
+    // Position of each name in entries, so single entries are found without a scan
+    std::unordered_map<std::string, size_t> positions;
+    // Monotonic time in milliseconds the remote last confirmed the entries
+    long long validated_ms = 0;
+    // Names looked up in the folder but missing from it and the monotonic time in milliseconds they were missed,
+    // a listing with a new ETag replaces the value, so they're only trusted while the folder is unchanged
+    std::unordered_map<std::string, long long> absent;
+    // Monotonic time in milliseconds readdir last prefetched the subfolder counts of the entries, 0 if it didn't since they changed
+    long long prefetched_ms = 0;
+};
+
+// Value used for caching the attributes getattr returned for a remote entry
+struct attr_cache_value {
+    struct stat st;
+    // Monotonic time in milliseconds the attributes were fetched
+    long long fetched_ms = 0;
+    attr_cache_value() { memset(&st, 0, sizeof(st)); }
 };
 
+// Block file of the disk cache handed to libfuse
+struct block_fd {
+    long long block;
+    long long size;
+    int fd;
+};
+
+// Upload state of a shadow file
+enum shadow_state {
+    SHADOW_IN_USE,
+    SHADOW_QUEUED,
+    SHADOW_UPLOADING,
+    SHADOW_UPLOADED
+};
+
+// Local shadow of a file in write-back mode, shared by the open handles of a path
+struct shadow_entry {
+    shadow_file *file = NULL;
+    // Remote file the shadow replaces, empty for a file created by create, which the upload creates on the remote
+    std::string remote_id;
+    bool created = false;
+    // Set by utimens on a created file before its upload, 0 uploads it with the current time
+    time_t modification_time = 0;
+    // Folder and name of the remote file
+    std::string parent_id;
+    std::string file_name;
+    int open_count = 0;
+    // Written or truncated since the upload started last
+    bool dirty = false;
+    // File was removed while open, the shadow is dropped on release
+    bool removed = false;
+    shadow_state state = SHADOW_IN_USE;
+    // ID of the remote file holding the uploaded content, empty if the upload failed
+    std::string uploaded_id;
+    // Journal record of an upload that was started, 0 if there is none, and the progress it recorded
+    unsigned long long journal_id = 0;
+    std::string temp_id;
+    long long acked = 0;
+    bool closed = false;
+    bool replaced = false;
+    // Failed upload attempts in this mount
+    int failures = 0;
+    // Bytes counted in shadow_backlog while the upload is queued or running
+    long long backlog_bytes = 0;
+    ~shadow_entry() { delete file; }
+};
+
+// Created file whose content is kept in memory until release uploads it together with its metadata
+struct buffered_file {
+    std::string path;
+    std::string parent_id;
+    std::string file_name;
+    std::vector<char> content;
+    // Set by utimens before the file is uploaded, 0 uploads it with the current time
+    time_t modification_time = 0;
+    // Unlinked or replaced, nothing is uploaded
+    bool removed = false;
+    // Released files wait for their upload in the background, the path is served locally until it finished
+    bool released = false;
+    bool uploading = false;
+    bool uploaded = false;
+    // ID of the created remote file, empty if the upload failed
+    std::string uploaded_id;
+    // Opens sharing the content, the last release creates the file
+    int open_count = 1;
+    // An open outgrew small_file_size and created the file on the remote, the other opens continue on it
+    bool spilled = false;
+};
+
+// State of an open file, stored in fuse_file_info::fh
+struct open_file {
+    // Prefetcher for sequential reads, only set for read only opens
+    read_ahead *prefetch = NULL;
+    // Coalesces writes, created by the first write
+    write_buffer *writer = NULL;
+    // Local shadow all reads and writes go to, only set in write-back mode
+    shadow_entry *shadow = NULL;
+    // Content of a created file that's still small enough to be buffered, shared by its opens, NULL once it's created on the remote
+    buffered_file *buffered = NULL;
+    // Block files used by replies of read_buf, libfuse reads them after read_buf returns
+    std::deque<block_fd> block_fds;
+    // Remote file of a read-write open whose content still has to be copied into the temp file, empty once nothing is left to copy
+    std::string copy_source;
+    // Size of copy_source, -1 until the first write looks it up
+    long long copy_size = -1;
+    // -1 until the first write creates the temp file, then the end of the range written from the start of the file,
+    // the copy only has to supply the bytes after it
+    long long copy_from = -1;
+    // Guards block_fds, the copy state and the creation of writer
+    pthread_mutex_t lock;
+    open_file() { pthread_mutex_init(&lock, NULL); }
+    ~open_file() {
+        delete prefetch;
+        delete writer;
+        delete buffered;
+        for (const block_fd &b : block_fds) close(b.fd);
+        pthread_mutex_destroy(&lock);
+    }
+};
+
+// Number of block files kept open per open file, more than the replies that can be in flight at once
+const int MAX_BLOCK_FDS = 64;
+
 // Authorization header for https requests
 std::string WdFs::auth_header = std::string("");
-// Maps remote IDs to local paths
-std::unordered_map<std::string, id_cache_value> remote_id_map;
+// Maps local paths to remote IDs, directory renames move the entries below them along
+dentry_tree dentries;
+// Metadata caches are shared by the fuse worker threads, each is sharded with a reader/writer lock per shard
 // Caches the count of subfolders for a given remote ID of a folder
-std::unordered_map<std::string, subfolder_cache_value> subfolder_count_cache;
+concurrent_map<subfolder_cache_value> subfolder_count_cache;
 // Maps a local path to a remote temp file's ID
-std::unordered_map<std::string, std::string> temp_file_binding;
+concurrent_map<std::string> temp_file_binding;
 // Maps a local path to a newly created remote file's ID
-std::unordered_map<std::string, std::string> create_opened_files;
+concurrent_map<std::string> create_opened_files;
 // Used for caching entries of a specific parent entry
-std::unordered_map<std::string, std::vector<bridge::entry_data>> list_entries_cache;
+concurrent_map<listing_cache_value> list_entries_cache;
+// Milliseconds a cached listing is used to resolve paths without asking the remote if it changed
+long long listing_ttl_ms = 1000;
+// Milliseconds a name missing from a folder is answered as absent without a request, 0 disables it
+long long negative_ttl_ms = 10000;
+// Absent names kept per folder before the expired ones are dropped
+const size_t MAX_ABSENT_NAMES = 1024;
+// Characters of subfolder IDs put into a single prefetch request, keeps its URL below the limits of servers and proxies
+const size_t MAX_PREFETCH_IDS_LENGTH = 2048;
+// Directories report 2 plus their subfolders as link count, otherwise 1, which tools like find take as unknown
+bool exact_nlink = false;
+// Seconds the kernel caches lookups, attributes and missing names, handed to libfuse by init
+int entry_timeout = 1;
+int attr_timeout = 1;
+int negative_timeout = 1;
+// Attributes returned by getattr for a remote ID, reused within attr_timeout without a request
+concurrent_map<attr_cache_value> attr_cache;
+// Bumped whenever an operation changes attributes, getattr doesn't cache what it fetched meanwhile
+std::atomic<unsigned long long> attr_generation(0);
 // Used for caching remote file sizes
-std::unordered_map<std::string, filesize_cache_value> filesize_cache;
+concurrent_map<filesize_cache_value> filesize_cache;
+// Caches blocks of file content shared by all open files
+block_cache *content_cache = NULL;
+// Keeps blocks of file content between mounts, backs content_cache
+disk_cache *disk_content_cache = NULL;
+// Size of the write buffer of open files
+int write_buffer_size = 16 * 1024 * 1024;
+// Bytes of buffered writes being uploaded at the same time for an open file
+long long upload_in_flight = 64 * 1024 * 1024;
+// Created files up to this size are uploaded in a single request once they're released
+long long small_file_size = 1024 * 1024;
+// Maps a local path to a created file that's only in memory yet
+std::unordered_map<std::string, buffered_file*> buffered_files;
+// Guards buffered_files and the content and state of its files
+pthread_mutex_t buffered_lock = PTHREAD_MUTEX_INITIALIZER;
+// Signaled whenever an upload of a buffered file finishes
+pthread_cond_t buffered_uploaded = PTHREAD_COND_INITIALIZER;
+// Paths of buffered files whose upload finished, applied by file system threads
+std::vector<std::string> buffered_finished;
+// Writes go to local shadow files, uploaded in the background on release
+bool writeback_mode = false;
+std::string shadow_dir;
+// Maps a local path to its shadow file in write-back mode
+std::unordered_map<std::string, shadow_entry*> shadow_files;
+// Guards shadow_files and the state of its entries
+pthread_mutex_t shadow_lock = PTHREAD_MUTEX_INITIALIZER;
+// Signaled whenever an upload of a shadow file finishes
+pthread_cond_t shadow_uploaded = PTHREAD_COND_INITIALIZER;
+// Unique name of the next shadow file, shadows are named <prefix><counter>
+unsigned long long shadow_counter = 0;
+const std::string SHADOW_PREFIX = "shadow-";
+// Bytes of released shadow files whose upload hasn't finished and the most there may be before release waits
+long long shadow_backlog = 0;
+long long upload_disk_budget = 1024LL * 1024 * 1024;
+// Uploads released files in the background, started by init after fuse daemonized
+upload_queue *background_uploads = NULL;
+int upload_workers = 4;
+// Records the progress of uploads, so they survive a crash or an unmount
+upload_journal *upload_journal_log = NULL;
+// Set while unmounting, failed uploads are left to the next mount
+bool uploads_stopping = false;
+// Attempts of an upload in a single mount and the longest wait between them in seconds
+const int MAX_UPLOAD_ATTEMPTS = 5;
+const int MAX_UPLOAD_BACKOFF = 30;
+
+static void settle_uploads();
+static void settle_buffered_uploads();
+static bool restore_shadow(const upload_journal::record &upload, const std::string &auth_header);
+static bool is_shadow_name(const std::string &name);
+static void upload_shadow(shadow_entry *entry, const std::string &auth_header);
 
 // Readonly open flag value
 const int MY_O_RDONLY = 32768;
@@ -72,6 +267,251 @@ void WdFs::set_authorization_header(std::string authorization_header) {
     LOG("Setting auth header to: %s\n", authorization_header.c_str());
 }
 
+// Set the tunables of the file system
+void WdFs::set_options(const WdFsOptions &options) {
+    delete content_cache;
+    delete disk_content_cache;
+    content_cache = NULL;
+    disk_content_cache = NULL;
+    if (options.disk_cache_size > 0 && !options.cache_dir.empty()) {
+        disk_content_cache = new disk_cache(options.cache_dir, options.disk_cache_size);
+        if (!disk_content_cache->load()) {
+            fprintf(stderr, "Disk cache at %s is unusable, continuing without it\n", options.cache_dir.c_str());
+            delete disk_content_cache;
+            disk_content_cache = NULL;
+        }
+    }
+    if (options.write_buffer_size > 0) write_buffer_size = options.write_buffer_size;
+    if (options.upload_in_flight > 0) upload_in_flight = options.upload_in_flight;
+    if (options.small_file_size >= 0) small_file_size = options.small_file_size;
+    if (options.upload_workers > 0) upload_workers = options.upload_workers;
+    if (options.upload_disk > 0) upload_disk_budget = options.upload_disk;
+    if (options.listing_ttl >= 0) listing_ttl_ms = options.listing_ttl * 1000LL;
+    if (options.negative_ttl >= 0) negative_ttl_ms = options.negative_ttl * 1000LL;
+    if (options.entry_timeout >= 0) entry_timeout = options.entry_timeout;
+    if (options.attr_timeout >= 0) attr_timeout = options.attr_timeout;
+    if (options.negative_timeout >= 0) negative_timeout = options.negative_timeout;
+    exact_nlink = options.exact_nlink;
+    if (options.cache_size > 0 || disk_content_cache != NULL) content_cache = new block_cache(options.cache_size, disk_content_cache);
+    writeback_mode = false;
+    if (options.writeback) {
+        std::vector<upload_journal::record> pending;
+        if (!options.shadow_dir.empty() && make_directories(options.shadow_dir)) {
+            shadow_dir = options.shadow_dir;
+            upload_journal_log = new upload_journal(shadow_dir);
+            writeback_mode = upload_journal_log->load(pending);
+        }
+        if (writeback_mode) {
+            // Uploads a previous mount didn't finish are queued by init
+            std::unordered_set<std::string> resumed;
+            for (const upload_journal::record &upload : pending) {
+                if (restore_shadow(upload, auth_header)) resumed.insert(upload.shadow_name);
+            }
+            // Other shadows were left behind by a crash before their upload started, they can't be matched to their files
+            // The directory may be shared, only files named like a shadow are removed
+            DIR *dir = ::opendir(shadow_dir.c_str());
+            struct dirent *de;
+            while (dir != NULL && (de = ::readdir(dir)) != NULL) {
+                std::string name(de->d_name);
+                if (de->d_type != DT_REG || !is_shadow_name(name) || resumed.find(name) != resumed.end()) continue;
+                ::unlink((shadow_dir + "/" + name).c_str());
+            }
+            if (dir != NULL) closedir(dir);
+        } else {
+            delete upload_journal_log;
+            upload_journal_log = NULL;
+            fprintf(stderr, "Shadow directory %s is unusable, continuing without write-back mode\n", options.shadow_dir.c_str());
+        }
+    }
+    LOG("Content cache size is %lld bytes in memory, %lld bytes on disk\n", options.cache_size, disk_content_cache != NULL ? options.disk_cache_size : 0LL);
+}
+
+// Initialize the file system once it's mounted
+void *WdFs::init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+    // Let the kernel splice read replies out of the block files of the disk cache
+    if (conn->capable & FUSE_CAP_SPLICE_READ) conn->want |= FUSE_CAP_SPLICE_READ;
+    if (conn->capable & FUSE_CAP_SPLICE_MOVE) conn->want |= FUSE_CAP_SPLICE_MOVE;
+    // Let the kernel pass written data in a pipe, write_buf splices it into the upload
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE) conn->want |= FUSE_CAP_SPLICE_WRITE;
+    // readdir returns the attributes of the entries along with their names
+    if (conn->capable & FUSE_CAP_READDIRPLUS) conn->want |= FUSE_CAP_READDIRPLUS;
+    // Kernel answers repeated lookups and stats itself, getattr keeps attributes for as long
+    cfg->entry_timeout = entry_timeout;
+    cfg->attr_timeout = attr_timeout;
+    cfg->negative_timeout = negative_timeout;
+    // Threads started before fuse daemonized don't exist in the daemon
+    if (writeback_mode) {
+        background_uploads = new upload_queue(upload_workers);
+        // Resume the uploads of the previous mount
+        std::vector<shadow_entry*> queued;
+        pthread_mutex_lock(&shadow_lock);
+        for (const auto &[path, entry] : shadow_files) {
+            if (entry->state == SHADOW_QUEUED) queued.push_back(entry);
+        }
+        pthread_mutex_unlock(&shadow_lock);
+        for (shadow_entry *entry : queued) background_uploads->push([entry]() { upload_shadow(entry, auth_header); });
+    }
+    return fuse_get_context()->private_data;
+}
+
+// Clean up the file system on unmount
+void WdFs::destroy(void *) {
+    // Released files are uploaded before unmounting, failing uploads are resumed by the next mount
+    uploads_stopping = true;
+    delete background_uploads;
+    background_uploads = NULL;
+    settle_uploads();
+    settle_buffered_uploads();
+    delete upload_journal_log;
+    upload_journal_log = NULL;
+    delete content_cache;
+    content_cache = NULL;
+    // Writes the index of the disk cache for the next mount
+    delete disk_content_cache;
+    disk_content_cache = NULL;
+}
+
+// Get the current time of the monotonic clock in milliseconds
+static long long monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// List the entries of a folder through list_entries_cache, a listing confirmed within listing_ttl_ms is used
+// without a request if use_fresh is set, otherwise the remote is asked if it changed
+static bridge::request_result list_folder(const std::string &folder_id, std::vector<bridge::entry_data> &entries, bool use_fresh, const std::string &auth_header) {
+    bool fresh = false;
+    long long now = monotonic_ms();
+    if (use_fresh) {
+        list_entries_cache.read(folder_id, [&](const listing_cache_value &cached) {
+            fresh = now - cached.validated_ms < listing_ttl_ms;
+            if (fresh) entries = cached.entries;
+        });
+    }
+    if (fresh) return bridge::REQUEST_CACHED;
+    entries.clear();
+    bridge::request_result res = bridge::list_entries(folder_id, auth_header, entries);
+    now = monotonic_ms();
+    if (res == bridge::REQUEST_SUCCESS) {
+        // Folder changed, names missed before might exist now
+        listing_cache_value cached;
+        cached.entries = entries;
+        for (size_t i = 0; i < entries.size(); i++) cached.positions.emplace(entries[i].name, i);
+        cached.validated_ms = now;
+        list_entries_cache.set(folder_id, cached);
+    } else if (res == bridge::REQUEST_CACHED) {
+        list_entries_cache.update_existing(folder_id, [&](listing_cache_value &cached) {
+            cached.validated_ms = now;
+            entries = cached.entries;
+        });
+    }
+    return res;
+}
+
+// Check if name was missed in a folder within negative_ttl_ms and the folder hasn't changed since
+static bool is_known_absent(const std::string &folder_id, const std::string &name) {
+    if (negative_ttl_ms <= 0) return false;
+    bool absent = false;
+    long long now = monotonic_ms();
+    list_entries_cache.read(folder_id, [&](const listing_cache_value &cached) {
+        auto it = cached.absent.find(name);
+        absent = it != cached.absent.end() && now - it->second < negative_ttl_ms;
+    });
+    return absent;
+}
+
+// Remember that name is missing from the cached listing of a folder
+static void remember_absent(const std::string &folder_id, const std::string &name) {
+    if (negative_ttl_ms <= 0) return;
+    long long now = monotonic_ms();
+    list_entries_cache.update_existing(folder_id, [&](listing_cache_value &cached) {
+        if (cached.absent.size() >= MAX_ABSENT_NAMES) {
+            for (auto it = cached.absent.begin(); it != cached.absent.end();) {
+                if (now - it->second >= negative_ttl_ms) it = cached.absent.erase(it);
+                else ++it;
+            }
+        }
+        if (cached.absent.size() < MAX_ABSENT_NAMES) cached.absent[name] = now;
+    });
+}
+
+// Forget that name was missing from a folder, called once an entry of that name is made in it
+static void forget_absent(const std::string &folder_id, const std::string &name) {
+    list_entries_cache.update_existing(folder_id, [&name](listing_cache_value &cached) { cached.absent.erase(name); });
+}
+
+// Get the attributes getattr fetched for path within attr_timeout
+static bool get_cached_attributes(const std::string &path, struct stat *st) {
+    if (attr_timeout <= 0) return false;
+    std::string remote_id;
+    bool is_dir = false;
+    if (!dentries.lookup(path, remote_id, is_dir)) return false;
+    bool fresh = false;
+    long long now = monotonic_ms();
+    attr_cache.read(remote_id, [&](const attr_cache_value &cached) {
+        fresh = now - cached.fetched_ms < attr_timeout * 1000LL;
+        if (fresh) *st = cached.st;
+    });
+    return fresh;
+}
+
+// Remember the attributes getattr fetched for path, unless an operation changed attributes since generation was read
+static void cache_attributes(const std::string &path, const struct stat *st, unsigned long long generation) {
+    if (attr_timeout <= 0) return;
+    std::string remote_id;
+    bool is_dir = false;
+    if (attr_generation != generation || !dentries.lookup(path, remote_id, is_dir)) return;
+    long long now = monotonic_ms();
+    attr_cache.update(remote_id, [&](attr_cache_value &cached) {
+        if (attr_generation != generation) return;
+        cached.st = *st;
+        cached.fetched_ms = now;
+    });
+}
+
+// Drop the cached attributes of path, called once an operation changed them
+static void invalidate_attributes(const std::string &path) {
+    attr_generation++;
+    std::string remote_id;
+    bool is_dir = false;
+    if (dentries.lookup(path, remote_id, is_dir)) attr_cache.erase(remote_id);
+}
+
+// Set the times of path to the ones in the cached listing of its folder, they're left alone if it isn't listed there
+static void set_listed_times(const std::string &path, struct stat *st) {
+    size_t last_slash = path.find_last_of('/');
+    if (last_slash == std::string::npos) return;
+    std::string folder_id;
+    bool is_dir = false;
+    if (!dentries.lookup(path.substr(0, last_slash), folder_id, is_dir)) return;
+    std::string name(path.substr(last_slash + 1));
+    list_entries_cache.read(folder_id, [&](const listing_cache_value &cached) {
+        auto position = cached.positions.find(name);
+        if (position == cached.positions.end()) return;
+        const bridge::entry_data &entry = cached.entries[position->second];
+        if (entry.modification_time == 0) return;
+        // Remote doesn't track access times
+        st->st_atime = entry.modification_time;
+        st->st_mtime = entry.modification_time;
+        st->st_ctime = entry.change_time != 0 ? entry.change_time : entry.modification_time;
+    });
+}
+
+// Set the modification time of path in the cached listing of its folder, once utimens changed it on the remote
+static void set_listed_modification_time(const std::string &path, time_t modification_time) {
+    size_t last_slash = path.find_last_of('/');
+    if (last_slash == std::string::npos) return;
+    std::string folder_id;
+    bool is_dir = false;
+    if (!dentries.lookup(path.substr(0, last_slash), folder_id, is_dir)) return;
+    std::string name(path.substr(last_slash + 1));
+    list_entries_cache.update_existing(folder_id, [&](listing_cache_value &cached) {
+        auto position = cached.positions.find(name);
+        if (position != cached.positions.end()) cached.entries[position->second].modification_time = modification_time;
+    });
+}
+
 // Split a string and get the individual parts
 std::vector<std::string> split_string(const std::string &input, const char delimiter) {
     std::vector<std::string> parts;
@@ -93,38 +533,35 @@ std::vector<std::string> split_string(const std::string &input, const char delim
 // Returns: 1 => folder found; 0 => folder not found, entry exists; -1 => entry doesn't exist
 list_entries_result list_entries_expand(const std::string &path, std::vector<bridge::entry_data> *result, const std::string &auth_header) {
     // Checks if the ID of the local path is cached
-    if (remote_id_map.find(path) != remote_id_map.end()) {
+    std::string entry_id;
+    bool is_dir = false;
+    if (dentries.lookup(path, entry_id, is_dir)) {
         LOG("[list_entries_expand]: Corresponding ID for %s was found in the cache\n", path.c_str());
-        LOG("[list_entries_expand]: Path's ID is: %s (%d)\n", remote_id_map[path].id.c_str(), remote_id_map[path].is_dir);
-        if (!remote_id_map[path].is_dir) return FILE_FOUND;
+        LOG("[list_entries_expand]: Path's ID is: %s (%d)\n", entry_id.c_str(), is_dir);
+        if (!is_dir) return FILE_FOUND;
         if (result != NULL) {
-            std::string entry_id = remote_id_map[path].id;
-            std::vector<bridge::entry_data> cache_results;
-            bridge::request_result res = bridge::list_entries(entry_id, auth_header, cache_results);
-            LOG("[list_entries_expand]: Cached entry had %d entries\n", cache_results.size());
-            if (res == bridge::REQUEST_SUCCESS) {
-                LOG("[list_entries_expand]: list_entries_cache invalidated\n");
-                *result = cache_results;
-                list_entries_cache[entry_id] = cache_results;
-            } else if (res == bridge::REQUEST_CACHED) {
-                LOG("[list_entries_expand]: list_entries_cache is valid\n");
-                *result = list_entries_cache[entry_id];
-            }
+            bridge::request_result res = list_folder(entry_id, *result, false, auth_header);
+            LOG("[list_entries_expand]: Cached entry had %d entries\n", result->size());
+            if (res == bridge::REQUEST_SUCCESS) LOG("[list_entries_expand]: list_entries_cache invalidated\n");
+            else if (res == bridge::REQUEST_CACHED) LOG("[list_entries_expand]: list_entries_cache is valid\n");
         }
         return FOLDER_FOUND;
     }
 
-    // Enumerates the IDs of parent folders
-    std::vector<std::string> parts = split_string(path, '/');
-    std::string current_id;
+    // Expansion starts at the deepest folder above the path whose ID is cached instead of the root
+    size_t prefix_length = 0;
+    std::string current_id = dentries.nearest_directory(path, prefix_length);
+    std::string current_full_path = path.substr(0, prefix_length);
+    // Enumerates the IDs of the folders below it
+    std::vector<std::string> parts = split_string(path.substr(prefix_length), '/');
     std::vector<bridge::entry_data> current_items;
-    std::string current_full_path;
+    bool listed = false;
 
-    // Expand the folders starting from root to the requested path
+    // Expand the folders starting from the cached folder to the requested path
     for (auto it = parts.begin(); it != parts.end(); ++it) {
         std::string current = *it;
         if (current.empty()) { // no current path so far
-            current_id = "root";
+            LOG("[list_entries_expand]: Expanding %s from %s\n", path.c_str(), current_full_path.empty() ? "/" : current_full_path.c_str());
         } else {
             current_full_path.append("/" + current);
             bool folder_found = false;
@@ -137,7 +574,7 @@ list_entries_result list_entries_expand(const std::string &path, std::vector<bri
                     entry_found = true;
                     // Cache the ID of the entry
                     current_id = current_entry.id;
-                    remote_id_map[current_full_path] = id_cache_value(current_entry.id, current_entry.is_dir);
+                    dentries.insert(current_full_path, current_entry.id, current_entry.is_dir);
                     if (current_entry.is_dir) { // The entry is a folder indeed
                         folder_found = true;
                         if (result == NULL && it + 1 == parts.end()) return FOLDER_FOUND;
@@ -145,18 +582,23 @@ list_entries_result list_entries_expand(const std::string &path, std::vector<bri
                     break;
                 }
             }
-            if (!folder_found && !entry_found) return NOT_FOUND; // The entry doesn't exist on the server
-            else if (!folder_found) return FILE_FOUND; // The entry exists but it's a file
+            if (!folder_found && !entry_found) { // The entry doesn't exist on the server
+                if (listed) remember_absent(current_id, current);
+                return NOT_FOUND;
+            } else if (!folder_found) return FILE_FOUND; // The entry exists but it's a file
         }
 
-        current_items.clear();
-        // List entries for the current path part
-        bridge::request_result res = bridge::list_entries(current_id, auth_header, current_items);
+        // A name missed in the folder before is absent while the folder is unchanged, it isn't listed again
+        if (it + 1 != parts.end() && is_known_absent(current_id, *(it + 1))) {
+            LOG("[list_entries_expand]: %s is known to be absent\n", (it + 1)->c_str());
+            return NOT_FOUND;
+        }
+        // List entries for the current path part, folders on the way are taken from a fresh listing without a request
+        bridge::request_result res = list_folder(current_id, current_items, it + 1 != parts.end(), auth_header);
+        listed = res != bridge::REQUEST_FAILED;
         if (res == bridge::REQUEST_CACHED) {
-            current_items = list_entries_cache[current_id];
             LOG("[list_entries_expand]: expanding -> results taken from cache\n");
         } else if (res == bridge::REQUEST_SUCCESS) {
-            list_entries_cache[current_id] = current_items;
             LOG("[list_entries_expand]: expanding -> results taken from server -> results cached\n");
         }
     }
@@ -170,15 +612,17 @@ list_entries_result list_entries_expand(const std::string &path, std::vector<bri
 
 // Get the ID of the remote entry corresponding to the local path given
 std::string get_path_remote_id(const std::string &path, const std::string &auth_header) {
+    std::string cached_id;
+    bool is_dir = false;
     if (path == "/" || path == "") { // check if path is root
         return "root";
-    } else if (remote_id_map.find(path) != remote_id_map.end()) { // check if path is in the cache
-        LOG("[get_remote_id]: Path is cached in remote_id_map\n");
-        return remote_id_map[path].id;
-    } else if (create_opened_files.find(path) != create_opened_files.end()) {
+    } else if (dentries.lookup(path, cached_id, is_dir)) { // check if path is in the cache
+        LOG("[get_remote_id]: Path is cached in the dentry tree\n");
+        return cached_id;
+    } else if (create_opened_files.get(path, cached_id)) {
         // This is a newly created, still open file, won't be listed by server
         LOG("[get_remote_id]: Path is a newly created file, that's still open, returning id from map\n");
-        return create_opened_files[path];
+        return cached_id;
     }
     LOG("[get_remote_id]: Path isn't cached, fetching id from server\n");
     // list_entries_expand automatically populates the cache if the entry exists
@@ -191,15 +635,19 @@ std::string get_path_remote_id(const std::string &path, const std::string &auth_
     return std::string("");
 }
 
-// Get the number of sub folders of a folder on the remote system
+// Get the number of sub folders of a folder on the remote system, the folder is only listed for it if link counts are exact
 int get_subfolder_count(const std::string &path, const std::string &auth_header) {
     LOG("[get_subfolder_count]: Requesting subfolder count for %s\n", path.c_str());
     std::string remote_id = get_path_remote_id(path, auth_header);
     if (remote_id.empty()) return -2; // Server doesn't have this entry
-    if (create_opened_files.find(path) != create_opened_files.end() || (remote_id != "root" && !remote_id_map[path].is_dir)) return -1; // Entry is not a directory
-    if (subfolder_count_cache.find(remote_id) != subfolder_count_cache.end()) {
+    std::string cached_id;
+    bool is_dir = false;
+    if (create_opened_files.contains(path) || (remote_id != "root" && !(dentries.lookup(path, cached_id, is_dir) && is_dir))) return -1; // Entry is not a directory
+    if (!exact_nlink) return 0;
+    subfolder_cache_value v;
+    bool count_cached = subfolder_count_cache.get(remote_id, v);
+    if (count_cached) {
         // Check if there are results inserted by readdir
-        subfolder_cache_value v = subfolder_count_cache[remote_id];
         if (v.is_hot == 1) {
             // Value is from readdir call, cache can be treated as valid
             v.is_hot = 0; // Invalidate cache after call
@@ -208,45 +656,45 @@ int get_subfolder_count(const std::string &path, const std::string &auth_header)
     }
     std::vector<bridge::entry_data> entries;
     bool cache_invalidated = false;
-    bridge::request_result res = bridge::list_entries(remote_id, auth_header, entries);
+    bridge::request_result res = list_folder(remote_id, entries, false, auth_header);
     if (res == bridge::REQUEST_FAILED) return -2;
     else if (res == bridge::REQUEST_SUCCESS) {
         // current cache invalid
         LOG("[get_subfolder_count]: server returned entries result\n");
-        list_entries_cache[remote_id] = entries;
         cache_invalidated = true;
     } else {
         // Request is cached, but not sure if subfolder_count is cached
         LOG("[get_subfolder_count]: Server returned result is cached\n");
     }
-    if (subfolder_count_cache.find(remote_id) == subfolder_count_cache.end() || cache_invalidated) {
+    if (!count_cached || cache_invalidated) {
         // check if the cache needs to be updated and update it
         LOG("[get_subfolder_count]: Subfolder count cache needs to be updated\n");
         int subfolder_count = 0;
-        for (const auto& entry : list_entries_cache[remote_id]) {
+        for (const auto& entry : entries) {
             //if (entry.is_dir) subfolder_count++;
             subfolder_count += entry.is_dir;
         }
         LOG("[get_subfolder_count]: Pushing %s => %d to subfolder cache\n", remote_id.c_str(), subfolder_count);
-        subfolder_count_cache[remote_id] = subfolder_cache_value(0, subfolder_count);
+        v = subfolder_cache_value(0, subfolder_count);
+        subfolder_count_cache.set(remote_id, v);
     }
     // subfolder_count cache is 100% up to date at this point
-    return subfolder_count_cache[remote_id].subfolder_count;
+    return v.subfolder_count;
 }
 
 // Get the size of a file on the remote system
-int path_get_size(const std::string &file_path, const std::string &auth_header) {
+long long path_get_size(const std::string &file_path, const std::string &auth_header) {
     // get the remote ID of the file
-    if (create_opened_files.find(file_path) != create_opened_files.end()) {
+    if (create_opened_files.contains(file_path)) {
         // if the file is a newly created, still open file, the remote won't know about it
         return 0;
     }
     std::string file_id = get_path_remote_id(file_path, auth_header);
     if (file_id.empty()) return -1;
-    int result = 0;
+    long long result = 0;
     // Check if cache is valid and return result from it if it is
-    if (filesize_cache.find(file_id) != filesize_cache.end()) {
-        filesize_cache_value v = filesize_cache[file_id];
+    filesize_cache_value v;
+    if (filesize_cache.get(file_id, v)) {
         if (v.is_hot == 1) {
             // Cache has valid value from previous readdir call
             v.is_hot = 0; // Invalidate cache after this call
@@ -254,20 +702,676 @@ int path_get_size(const std::string &file_path, const std::string &auth_header)
         }
     }
     // Cache might not be valid
-    bridge::request_result res = bridge::get_file_size(file_id, result, auth_header);
+    std::string etag;
+    bridge::request_result res = bridge::get_file_size(file_id, result, auth_header, &etag);
     if (res == bridge::REQUEST_SUCCESS) {
         // Server sent new file size, invalidated the cache
-        filesize_cache[file_id].filesize = result;
+        filesize_cache.update(file_id, [result](filesize_cache_value &cached) { cached.filesize = result; });
+        // Cached content is stale if the file changed on the remote
+        if (content_cache != NULL) content_cache->validate(file_id, result, etag);
     } else if (res == bridge::REQUEST_FAILED) return -1;
 
     // Cache is 100% valid at this point
-    return filesize_cache[file_id].filesize;
+    if (res == bridge::REQUEST_CACHED) return filesize_cache.get(file_id, v) ? v.filesize : -1;
+    return result;
+}
+
+// Get the size of a remote file, taken from filesize_cache while the remote reports it unchanged, -1 on failure
+static long long get_remote_file_size(const std::string &remote_id, const std::string &auth_header) {
+    long long remote_file_size = -1;
+    bridge::request_result res = bridge::get_file_size(remote_id, remote_file_size, auth_header);
+    filesize_cache_value cached;
+    if (res == bridge::REQUEST_CACHED) remote_file_size = filesize_cache.get(remote_id, cached) ? cached.filesize : -1; // Load size from cache
+    else if (res == bridge::REQUEST_SUCCESS) filesize_cache.update(remote_id, [remote_file_size](filesize_cache_value &v) { v.filesize = remote_file_size; }); // Push new size to cache
+    return remote_file_size;
+}
+
+// Copy the bytes of a remote file from start up to size into a temp file, the copy stops if the calling operation is interrupted
+static bool copy_to_temp_file(const std::string &remote_id, const std::string &location_hdr, long long size, const char *operation, const std::string &auth_header, long long start = 0) {
+    copy_engine engine(auth_header, [operation](long long copied, long long total) {
+        LOG("[%s]: Copied %lld/%lld bytes to the temp file\n", operation, copied, total);
+    }, []() {
+        return fuse_interrupted() != 0;
+    });
+    return engine.copy(remote_id, location_hdr, size, start);
+}
+
+// Apply the uploads of shadow files that finished, the ID caches are only changed by file system threads
+// Called with shadow_lock held
+static void settle_uploads_locked() {
+    for (auto it = shadow_files.begin(); it != shadow_files.end();) {
+        shadow_entry *entry = it->second;
+        if (entry->state != SHADOW_UPLOADED) {
+            ++it;
+            continue;
+        }
+        if (!entry->uploaded_id.empty()) {
+            // Content of the old file is replaced by the uploaded one
+            if (!entry->created && content_cache != NULL) content_cache->invalidate(entry->remote_id);
+            filesize_cache.erase(entry->remote_id);
+            dentries.insert(it->first, entry->uploaded_id, false);
+        } else {
+            LOG("[writeback]: Upload of %s failed, the remote file is unchanged\n", it->first.c_str());
+        }
+        delete entry;
+        it = shadow_files.erase(it);
+    }
+}
+
+static void settle_uploads() {
+    pthread_mutex_lock(&shadow_lock);
+    settle_uploads_locked();
+    pthread_mutex_unlock(&shadow_lock);
+}
+
+// Count the bytes of a shadow in shadow_backlog while its upload is pending, called with shadow_lock held
+static void count_shadow_backlog(shadow_entry *entry, bool pending) {
+    shadow_backlog -= entry->backlog_bytes;
+    entry->backlog_bytes = pending ? entry->file->size() : 0;
+    shadow_backlog += entry->backlog_bytes;
+}
+
+// Wait until the queued upload of a path finished, so the remote has the content released last
+static void wait_shadow_upload(const std::string &path) {
+    pthread_mutex_lock(&shadow_lock);
+    while (true) {
+        auto it = shadow_files.find(path);
+        if (it == shadow_files.end() || it->second->state == SHADOW_IN_USE) break;
+        if (it->second->state == SHADOW_UPLOADED) settle_uploads_locked();
+        else pthread_cond_wait(&shadow_uploaded, &shadow_lock);
+    }
+    pthread_mutex_unlock(&shadow_lock);
+}
+
+// Get the size of the shadow of a path, returns -1 if the path has none
+static long long get_shadow_size(const std::string &path) {
+    pthread_mutex_lock(&shadow_lock);
+    settle_uploads_locked();
+    auto it = shadow_files.find(path);
+    shadow_entry *entry = it != shadow_files.end() ? it->second : NULL;
+    // Size can't change while the file is being uploaded, only handles holding the entry change it
+    long long size = entry != NULL ? entry->file->size() : -1;
+    pthread_mutex_unlock(&shadow_lock);
+    return size;
+}
+
+// Check if a file in the shadow directory is named like a shadow
+static bool is_shadow_name(const std::string &name) {
+    if (name.size() <= SHADOW_PREFIX.size() || name.compare(0, SHADOW_PREFIX.size(), SHADOW_PREFIX) != 0) return false;
+    return name.find_first_not_of("0123456789", SHADOW_PREFIX.size()) == std::string::npos;
+}
+
+// Create the local file of a shadow starting with the first size bytes of a remote file, returns NULL on failure
+static shadow_file *create_shadow_file(const std::string &remote_id, long long size, const std::string &auth_header) {
+    pthread_mutex_lock(&shadow_lock);
+    std::string shadow_path;
+    // Shadows of unfinished uploads from a previous mount are still around
+    do {
+        shadow_path = shadow_dir + "/" + SHADOW_PREFIX + std::to_string(shadow_counter++);
+    } while (access(shadow_path.c_str(), F_OK) == 0);
+    pthread_mutex_unlock(&shadow_lock);
+    shadow_file *file = new shadow_file(shadow_path, remote_id, size, auth_header, content_cache);
+    if (!file->create()) {
+        delete file;
+        return NULL;
+    }
+    LOG("[writeback]: Shadow of %s is %s\n", remote_id.c_str(), shadow_path.c_str());
+    return file;
+}
+
+// Get the shadow of a path for a new user, the shadow of an existing remote file is created if create_missing is set
+// Returns NULL with error set if the shadow can't be created, or with error 0 if there is none
+static shadow_entry *acquire_shadow(const std::string &path, bool create_missing, int &error, const std::string &auth_header) {
+    error = 0;
+    pthread_mutex_lock(&shadow_lock);
+    while (true) {
+        auto it = shadow_files.find(path);
+        if (it == shadow_files.end()) break;
+        shadow_entry *entry = it->second;
+        if (entry->state == SHADOW_UPLOADING) {
+            // Close-to-open consistency, the new user sees the remote file once the upload is done
+            pthread_cond_wait(&shadow_uploaded, &shadow_lock);
+        } else if (entry->state == SHADOW_UPLOADED) {
+            settle_uploads_locked();
+        } else {
+            // A queued upload is taken back, the next release queues it again
+            entry->state = SHADOW_IN_USE;
+            count_shadow_backlog(entry, false);
+            entry->open_count++;
+            pthread_mutex_unlock(&shadow_lock);
+            return entry;
+        }
+    }
+    pthread_mutex_unlock(&shadow_lock);
+    if (!create_missing) return NULL;
+
+    std::string remote_id = get_path_remote_id(path, auth_header);
+    if (remote_id.empty()) {
+        error = -ENOENT;
+        return NULL;
+    }
+    long long remote_file_size = get_remote_file_size(remote_id, auth_header);
+    if (remote_file_size == -1) {
+        error = -EIO;
+        return NULL;
+    }
+    int last_slash = path.find_last_of('/');
+    shadow_entry *entry = new shadow_entry();
+    entry->remote_id = remote_id;
+    entry->parent_id = get_path_remote_id(path.substr(0, last_slash), auth_header);
+    entry->file_name = path.substr(last_slash + 1);
+
+    entry->file = create_shadow_file(remote_id, remote_file_size, auth_header);
+    if (entry->file == NULL) {
+        delete entry;
+        error = -EIO;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&shadow_lock);
+    if (shadow_files.find(path) != shadow_files.end()) {
+        // Another user created the shadow meanwhile
+        pthread_mutex_unlock(&shadow_lock);
+        delete entry;
+        return acquire_shadow(path, create_missing, error, auth_header);
+    }
+    shadow_files[path] = entry;
+    entry->open_count++;
+    pthread_mutex_unlock(&shadow_lock);
+    return entry;
+}
+
+// Find the path of a shadow waiting for its upload, returns false if it was taken back or uploaded already
+// Called with shadow_lock held
+static bool find_queued_shadow(shadow_entry *entry, std::string &path) {
+    for (const auto &[current_path, current] : shadow_files) {
+        if (current != entry) continue;
+        path = current_path;
+        return entry->state == SHADOW_QUEUED;
+    }
+    return false;
+}
+
+// Apply renames and utimens of a created file made while it was uploaded to the remote file file_id
+// current reads the metadata of the path and returns false once it's removed, lock is held on entry and exit
+// Returns false if a request failed
+static bool follow_local_changes(const std::string &file_id, pthread_mutex_t *lock, std::string parent_id, std::string file_name, time_t modification_time, const std::function<bool(std::string&, std::string&, time_t&)> &current, const std::string &auth_header) {
+    bool success = true;
+    std::string new_parent_id = parent_id, new_file_name = file_name;
+    time_t new_modification_time = modification_time;
+    while (success && current(new_parent_id, new_file_name, new_modification_time)) {
+        bool moved = new_parent_id != parent_id;
+        bool renamed = new_file_name != file_name;
+        bool touched = new_modification_time != modification_time;
+        if (!(moved || renamed || touched)) break;
+        parent_id = new_parent_id;
+        file_name = new_file_name;
+        modification_time = new_modification_time;
+        pthread_mutex_unlock(lock);
+        if (moved) success = bridge::move_entry(file_id, parent_id, auth_header);
+        if (success && renamed) success = bridge::rename_entry(file_id, file_name, auth_header);
+        if (success && touched) bridge::set_modification_time(file_id, modification_time, auth_header);
+        pthread_mutex_lock(lock);
+    }
+    return success;
+}
+
+// Give up the journaled upload of a shadow whose content changed since, the temp file is removed from the remote
+static void abandon_upload(shadow_entry *entry, const std::string &auth_header) {
+    if (entry->journal_id == 0) return;
+    if (!entry->temp_id.empty()) {
+        bridge::file_write_close(entry->temp_id, auth_header);
+        bridge::remove_entry(entry->temp_id, auth_header);
+    }
+    upload_journal_log->finished(entry->journal_id);
+    entry->journal_id = 0;
+    entry->temp_id.clear();
+    entry->acked = 0;
+    entry->closed = false;
+    entry->replaced = false;
+}
+
+// Upload the content of a shadow file to the remote, runs on the upload thread
+// Every step is journaled, an interrupted upload continues from the last acknowledged offset
+static void upload_shadow(shadow_entry *entry, const std::string &auth_header) {
+    std::string path;
+    pthread_mutex_lock(&shadow_lock);
+    if (!find_queued_shadow(entry, path)) {
+        // Taken back by an open or uploaded by an earlier job already
+        pthread_mutex_unlock(&shadow_lock);
+        return;
+    }
+    int failures = entry->failures;
+    pthread_mutex_unlock(&shadow_lock);
+    if (failures > 0 && !uploads_stopping) {
+        // Back off after failed attempts, an open may take the shadow back meanwhile
+        sleep(std::min(failures * 2, MAX_UPLOAD_BACKOFF));
+        pthread_mutex_lock(&shadow_lock);
+        bool queued = find_queued_shadow(entry, path);
+        pthread_mutex_unlock(&shadow_lock);
+        if (!queued) return;
+    }
+    pthread_mutex_lock(&shadow_lock);
+    entry->state = SHADOW_UPLOADING;
+    bool changed = entry->dirty;
+    entry->dirty = false;
+    std::string parent_id = entry->parent_id;
+    std::string file_name = entry->file_name;
+    time_t modification_time = entry->modification_time;
+    pthread_mutex_unlock(&shadow_lock);
+
+    bool success = true;
+    if (changed) abandon_upload(entry, auth_header);
+    long long size = entry->file->size();
+    if (entry->journal_id == 0) {
+        // Content has to be complete on the disk before the journal refers to it
+        success = entry->file->fill(0, size) && entry->file->sync();
+        if (success) {
+            upload_journal::record upload;
+            upload.shadow_name = entry->file->local_path().substr(shadow_dir.size() + 1);
+            upload.path = path;
+            upload.remote_id = entry->remote_id;
+            upload.created = entry->created;
+            upload.parent_id = parent_id;
+            upload.size = size;
+            entry->journal_id = upload_journal_log->begin(upload);
+        }
+    }
+    // Small created files are created with their content in a single request, unless a previous attempt created the file already
+    bool single_request = entry->created && entry->temp_id.empty() && size <= small_file_size;
+    if (success && single_request) {
+        std::vector<char> content(size);
+        success = entry->file->read(content.data(), 0, (int)size) == size && bridge::upload_file(parent_id, file_name, content.data(), size, modification_time, auth_header, entry->temp_id);
+        if (success) {
+            // Journaled right away, a resumed upload must not create the file a second time
+            upload_journal_log->temp_opened(entry->journal_id, entry->temp_id);
+            upload_journal_log->acknowledged(entry->journal_id, size);
+            upload_journal_log->closed(entry->journal_id);
+            entry->acked = size;
+            entry->closed = true;
+        }
+    }
+    // Remote can't write to a file after it's closed, existing files are replaced by a temp file, created files are uploaded under their name
+    if (success && entry->temp_id.empty()) {
+        success = bridge::file_write_open(parent_id, entry->created ? file_name : file_name + ".bridge_temp_file", auth_header, entry->temp_id);
+        if (success) upload_journal_log->temp_opened(entry->journal_id, entry->temp_id);
+    }
+    if (success && entry->acked < size) {
+        if (entry->acked > 0) LOG("[writeback]: Resuming upload of %s at %lld/%lld\n", path.c_str(), entry->acked, size);
+        unsigned long long journal_id = entry->journal_id;
+        success = entry->file->upload("sdk/v2/files/" + entry->temp_id, write_buffer_size, upload_in_flight, entry->acked, [entry, journal_id](long long acked) {
+            entry->acked = acked;
+            upload_journal_log->acknowledged(journal_id, acked);
+        });
+    }
+    if (success && !entry->closed) {
+        success = entry->closed = bridge::file_write_close(entry->temp_id, auth_header);
+        if (success) upload_journal_log->closed(entry->journal_id);
+    }
+    if (success && !entry->created && !entry->replaced) {
+        success = entry->replaced = bridge::remove_entry(entry->remote_id, auth_header);
+        if (success) upload_journal_log->replaced(entry->journal_id);
+    }
+    if (success && !entry->created) success = bridge::rename_entry(entry->temp_id, file_name, auth_header);
+    if (success && entry->created && modification_time != 0 && !single_request) bridge::set_modification_time(entry->temp_id, modification_time, auth_header);
+    if (success) {
+        upload_journal_log->finished(entry->journal_id);
+        entry->journal_id = 0;
+    }
+
+    pthread_mutex_lock(&shadow_lock);
+    // Renames and utimens of a created file while it was uploaded are applied afterwards
+    if (success && entry->created && !follow_local_changes(entry->temp_id, &shadow_lock, parent_id, file_name, modification_time, [entry](std::string &current_parent_id, std::string &current_file_name, time_t &current_modification_time) {
+            current_parent_id = entry->parent_id;
+            current_file_name = entry->file_name;
+            current_modification_time = entry->modification_time;
+            return !entry->removed;
+        }, auth_header)) {
+        LOG("[writeback]: Failed to apply the renames of %s to the uploaded file\n", path.c_str());
+    }
+    if (entry->removed) {
+        // Created file was unlinked while it was uploaded, the shadow isn't in the map anymore
+        count_shadow_backlog(entry, false);
+        pthread_cond_broadcast(&shadow_uploaded);
+        pthread_mutex_unlock(&shadow_lock);
+        LOG("[writeback]: Upload of %s dropped\n", path.c_str());
+        if (entry->journal_id != 0) abandon_upload(entry, auth_header);
+        else if (success) bridge::remove_entry(entry->temp_id, auth_header);
+        delete entry;
+        return;
+    }
+    LOG("[writeback]: Upload of %s %s\n", path.c_str(), success ? "finished" : "failed");
+    bool retry = false;
+    if (success) {
+        entry->uploaded_id = entry->temp_id;
+        entry->state = SHADOW_UPLOADED;
+    } else if (!uploads_stopping && entry->failures < MAX_UPLOAD_ATTEMPTS) {
+        // Shadow stays the content of the path until an attempt succeeds
+        entry->failures++;
+        // Rename during the attempt isn't applied to a partial upload of a created file, the retry starts over
+        if (entry->created && (entry->parent_id != parent_id || entry->file_name != file_name)) entry->dirty = true;
+        entry->state = SHADOW_QUEUED;
+        retry = true;
+    } else if (entry->journal_id != 0) {
+        // Journal keeps the upload for the next mount
+        LOG("[writeback]: Giving up on the upload of %s until the next mount\n", path.c_str());
+        entry->file->keep();
+        entry->state = SHADOW_UPLOADED;
+    } else {
+        LOG("[writeback]: Giving up on the upload of %s, the changes are lost\n", path.c_str());
+        entry->state = SHADOW_UPLOADED;
+    }
+    if (entry->state == SHADOW_UPLOADED) count_shadow_backlog(entry, false);
+    pthread_cond_broadcast(&shadow_uploaded);
+    pthread_mutex_unlock(&shadow_lock);
+    if (retry) background_uploads->push([entry, auth_header]() { upload_shadow(entry, auth_header); });
+}
+
+// Queue the unfinished upload of a previous mount, returns false if its shadow is gone
+static bool restore_shadow(const upload_journal::record &upload, const std::string &auth_header) {
+    shadow_entry *entry = new shadow_entry();
+    entry->file = new shadow_file(shadow_dir + "/" + upload.shadow_name, upload.remote_id, 0, auth_header, NULL);
+    if (!entry->file->open_existing(upload.size)) {
+        LOG("[writeback]: Shadow of the unfinished upload of %s is gone\n", upload.path.c_str());
+        upload_journal_log->finished(upload.id);
+        delete entry;
+        return false;
+    }
+    entry->remote_id = upload.remote_id;
+    entry->created = upload.created;
+    entry->parent_id = upload.parent_id;
+    entry->file_name = upload.path.substr(upload.path.find_last_of('/') + 1);
+    entry->journal_id = upload.id;
+    entry->temp_id = upload.temp_id;
+    entry->acked = upload.acked;
+    entry->closed = upload.closed;
+    entry->replaced = upload.replaced;
+    entry->state = SHADOW_QUEUED;
+    count_shadow_backlog(entry, true);
+    auto previous = shadow_files.find(upload.path);
+    if (previous != shadow_files.end()) {
+        // Records are loaded in order, the later upload of a path replaces the earlier one
+        abandon_upload(previous->second, auth_header);
+        count_shadow_backlog(previous->second, false);
+        delete previous->second;
+    }
+    shadow_files[upload.path] = entry;
+    LOG("[writeback]: Resuming the upload of %s at %lld/%lld bytes\n", upload.path.c_str(), upload.acked, upload.size);
+    return true;
+}
+
+// Release a user of a shadow, the last one queues the upload if the shadow changed
+static void release_shadow(shadow_entry *entry, const std::string &auth_header) {
+    pthread_mutex_lock(&shadow_lock);
+    // Last user waits while the released shadows waiting for their upload exceed the disk budget, so writers can't outrun the uploads
+    while (entry->open_count == 1 && entry->dirty && !entry->removed && shadow_backlog > 0 && shadow_backlog + entry->file->size() > upload_disk_budget) {
+        pthread_cond_wait(&shadow_uploaded, &shadow_lock);
+    }
+    entry->open_count--;
+    bool queue_upload = false;
+    shadow_entry *removed = NULL;
+    if (entry->open_count == 0) {
+        if (entry->removed) {
+            removed = entry;
+        } else if (entry->dirty || entry->journal_id != 0) {
+            // Upload of a shadow that failed before is retried even if nothing changed
+            entry->state = SHADOW_QUEUED;
+            count_shadow_backlog(entry, true);
+            queue_upload = true;
+        } else {
+            // Nothing changed, the remote file is up to date
+            for (auto it = shadow_files.begin(); it != shadow_files.end(); ++it) {
+                if (it->second != entry) continue;
+                shadow_files.erase(it);
+                break;
+            }
+            delete entry;
+        }
+    }
+    pthread_mutex_unlock(&shadow_lock);
+    if (queue_upload) background_uploads->push([entry, auth_header]() { upload_shadow(entry, auth_header); });
+    if (removed != NULL) {
+        // File is gone, so is anything uploaded for it
+        abandon_upload(removed, auth_header);
+        delete removed;
+    }
+}
+
+static void mark_shadow_dirty(shadow_entry *entry) {
+    pthread_mutex_lock(&shadow_lock);
+    entry->dirty = true;
+    pthread_mutex_unlock(&shadow_lock);
+}
+
+// Apply the uploads of buffered files that finished, the ID caches are only changed by file system threads
+// Called with buffered_lock held
+static void settle_buffered_uploads_locked() {
+    for (const std::string &path : buffered_finished) {
+        auto it = buffered_files.find(path);
+        if (it == buffered_files.end() || !it->second->uploaded) continue;
+        buffered_file *file = it->second;
+        if (!file->uploaded_id.empty()) dentries.insert(path, file->uploaded_id, false);
+        else LOG("[release]: Upload of %s failed, the file isn't created\n", path.c_str());
+        delete file;
+        buffered_files.erase(it);
+    }
+    buffered_finished.clear();
+}
+
+static void settle_buffered_uploads() {
+    pthread_mutex_lock(&buffered_lock);
+    settle_buffered_uploads_locked();
+    pthread_mutex_unlock(&buffered_lock);
+}
+
+// Wait until the upload of a released buffered file at path finished, so the remote has its content
+static void wait_buffered_upload(const std::string &path) {
+    pthread_mutex_lock(&buffered_lock);
+    while (true) {
+        auto it = buffered_files.find(path);
+        if (it == buffered_files.end() || !it->second->released) break;
+        if (it->second->uploaded) settle_buffered_uploads_locked();
+        else pthread_cond_wait(&buffered_uploaded, &buffered_lock);
+    }
+    pthread_mutex_unlock(&buffered_lock);
+}
+
+// Wait until the released files inside a directory are uploaded, the directory can't change under their uploads
+static void wait_directory_uploads(const std::string &dir_path) {
+    std::string prefix = dir_path == "/" ? dir_path : dir_path + "/";
+    auto inside = [&prefix](const std::string &path) { return path.compare(0, prefix.size(), prefix) == 0; };
+    pthread_mutex_lock(&buffered_lock);
+    while (true) {
+        settle_buffered_uploads_locked();
+        bool pending = false;
+        for (const auto &[path, file] : buffered_files) pending = pending || (file->released && inside(path));
+        if (!pending) break;
+        pthread_cond_wait(&buffered_uploaded, &buffered_lock);
+    }
+    pthread_mutex_unlock(&buffered_lock);
+    if (!writeback_mode) return;
+    pthread_mutex_lock(&shadow_lock);
+    while (true) {
+        settle_uploads_locked();
+        bool pending = false;
+        for (const auto &[path, entry] : shadow_files) pending = pending || (entry->state != SHADOW_IN_USE && inside(path));
+        if (!pending) break;
+        pthread_cond_wait(&shadow_uploaded, &shadow_lock);
+    }
+    pthread_mutex_unlock(&shadow_lock);
+}
+
+// Upload a released buffered file, returns false if it couldn't be created on the remote
+// Renames, utimens and unlinks of the path by other threads while the upload runs are applied to the created file afterwards
+static bool upload_buffered_file(buffered_file *file, const std::string &auth_header) {
+    pthread_mutex_lock(&buffered_lock);
+    bool removed = file->removed;
+    file->released = !removed;
+    file->uploading = !removed;
+    std::string parent_id = file->parent_id;
+    std::string file_name = file->file_name;
+    time_t modification_time = file->modification_time;
+    pthread_mutex_unlock(&buffered_lock);
+
+    // Content doesn't change once the file is released
+    std::string new_id;
+    bool success = removed;
+    for (int attempt = 1; !success; attempt++) {
+        success = bridge::upload_file(parent_id, file_name, file->content.data(), (long long)file->content.size(), modification_time, auth_header, new_id);
+        if (success || uploads_stopping || attempt == MAX_UPLOAD_ATTEMPTS) break;
+        sleep(std::min(attempt * 2, MAX_UPLOAD_BACKOFF));
+    }
+
+    pthread_mutex_lock(&buffered_lock);
+    if (success && !removed && !follow_local_changes(new_id, &buffered_lock, parent_id, file_name, modification_time, [file](std::string &current_parent_id, std::string &current_file_name, time_t &current_modification_time) {
+            current_parent_id = file->parent_id;
+            current_file_name = file->file_name;
+            current_modification_time = file->modification_time;
+            return !file->removed;
+        }, auth_header)) {
+        LOG("[release]: Failed to apply the renames of %s to the uploaded file\n", file->path.c_str());
+    }
+    removed = file->removed;
+    if (removed && !new_id.empty()) {
+        // Unlinked while it was uploaded
+        pthread_mutex_unlock(&buffered_lock);
+        bridge::remove_entry(new_id, auth_header);
+        pthread_mutex_lock(&buffered_lock);
+    }
+    LOG("[release]: Upload of created file %s %s\n", file->path.c_str(), removed ? "dropped" : success ? "finished" : "failed");
+    if (removed) {
+        delete file;
+    } else {
+        file->uploaded_id = success ? new_id : std::string("");
+        file->uploading = false;
+        file->uploaded = true;
+        buffered_finished.push_back(file->path);
+    }
+    pthread_cond_broadcast(&buffered_uploaded);
+    pthread_mutex_unlock(&buffered_lock);
+    return success;
+}
+
+// Run apply on the created file at path if it's only local yet, changes made while it's uploaded are applied by the upload afterwards
+// apply gets either the buffered file or the shadow and runs with its lock held, returns false if there is no such file
+static bool update_local_file(const std::string &path, const std::function<void(buffered_file*, shadow_entry*)> &apply) {
+    bool found = false;
+    pthread_mutex_lock(&buffered_lock);
+    while (true) {
+        auto it = buffered_files.find(path);
+        if (it == buffered_files.end()) break;
+        buffered_file *file = it->second;
+        if (file->uploaded) {
+            settle_buffered_uploads_locked();
+        } else {
+            // Changes made while the file is uploaded are applied by its upload afterwards
+            apply(file, NULL);
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&buffered_lock);
+    if (found || !writeback_mode) return found;
+    pthread_mutex_lock(&shadow_lock);
+    while (true) {
+        auto it = shadow_files.find(path);
+        if (it == shadow_files.end() || !it->second->created) break;
+        shadow_entry *entry = it->second;
+        if (entry->state == SHADOW_UPLOADED) {
+            settle_uploads_locked();
+        } else {
+            apply(NULL, entry);
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shadow_lock);
+    return found;
+}
+
+// Collect the names of the created files inside a directory that are only local yet, the remote doesn't list them
+// If with_shadowed is set, remote files with a local shadow are collected too, their content is local until the upload
+static void list_local_files(const std::string &dir_path, std::vector<std::string> &names, bool with_shadowed = false) {
+    std::string prefix = dir_path == "/" ? dir_path : dir_path + "/";
+    auto add = [&prefix, &names](const std::string &path) {
+        if (path.compare(0, prefix.size(), prefix) == 0 && path.find('/', prefix.size()) == std::string::npos) names.push_back(path.substr(prefix.size()));
+    };
+    pthread_mutex_lock(&buffered_lock);
+    for (const auto &[path, file] : buffered_files) add(path);
+    pthread_mutex_unlock(&buffered_lock);
+    if (!writeback_mode) return;
+    pthread_mutex_lock(&shadow_lock);
+    for (const auto &[path, entry] : shadow_files) {
+        if (entry->created || with_shadowed) add(path);
+    }
+    pthread_mutex_unlock(&shadow_lock);
+}
+
+// Check if a path is a created file that's only local yet, the remote file is created under its path by its upload
+static bool is_local_only(const std::string &path) {
+    return update_local_file(path, [](buffered_file*, shadow_entry*) {});
+}
+
+// Keep the modification time of a created file that's only local yet, it's sent along with the upload
+// Returns false if the path isn't one
+static bool set_local_modification_time(const std::string &path, time_t modification_time) {
+    return update_local_file(path, [modification_time](buffered_file *file, shadow_entry *entry) {
+        if (file != NULL) file->modification_time = modification_time;
+        else entry->modification_time = modification_time;
+    });
+}
+
+// Drop the created file at path if it's only local yet, returns false if there is none
+static bool remove_local_file(const std::string &path, const std::string &auth_header) {
+    shadow_entry *dropped = NULL;
+    bool found = update_local_file(path, [&path, &dropped](buffered_file *file, shadow_entry *entry) {
+        if (file != NULL) {
+            // Freed by its release or its queued upload
+            file->removed = true;
+            buffered_files.erase(path);
+            return;
+        }
+        entry->removed = true;
+        shadow_files.erase(path);
+        // Queued upload finds the shadow gone, a running one drops it, an open shadow is dropped by its last release
+        if (entry->open_count == 0 && entry->state != SHADOW_UPLOADING) {
+            count_shadow_backlog(entry, false);
+            dropped = entry;
+        }
+    });
+    if (dropped != NULL) {
+        abandon_upload(dropped, auth_header);
+        delete dropped;
+    }
+    return found;
+}
+
+// Change the size of a created file that's only in memory yet, returns false if the path isn't one or the size is too large
+static bool truncate_buffered_file(const std::string &path, long long size) {
+    pthread_mutex_lock(&buffered_lock);
+    auto it = buffered_files.find(path);
+    bool found = it != buffered_files.end() && !it->second->released && size <= small_file_size;
+    if (found) it->second->content.resize(size);
+    pthread_mutex_unlock(&buffered_lock);
+    return found;
 }
 
 // Change the size of the given file
 int WdFs::truncate(const char* path, off_t offset, struct fuse_file_info *fi) {
     LOG("[truncate]: Called for path %s\n Offset: %d\n", path, offset);
     std::string str_path(path);
+    if (truncate_buffered_file(str_path, offset)) return 0;
+    wait_buffered_upload(str_path);
+    if (writeback_mode) {
+        // Only the shadow changes, the upload happens once the last user released it
+        int error = 0;
+        shadow_entry *entry = acquire_shadow(str_path, true, error, auth_header);
+        if (entry == NULL) return error;
+        bool success = entry->file->truncate(offset);
+        if (success) mark_shadow_dirty(entry);
+        release_shadow(entry, auth_header);
+        return success ? 0 : -EIO;
+    }
     int last_slash = str_path.find_last_of('/');
     std::string parent_path(str_path.substr(0, last_slash));
     std::string file_name(str_path.substr(last_slash + 1) + ".bridge_temp_file");
@@ -277,41 +1381,22 @@ int WdFs::truncate(const char* path, off_t offset, struct fuse_file_info *fi) {
     LOG("[truncate]: Parent folder ID is: %s\n", parent_id.c_str());
     // Load parts of remote file into the temp file
     std::string remote_id = get_path_remote_id(str_path, auth_header);
-    int remote_file_size = -1;
-    // Get size of the remote file
-    bridge::request_result res = bridge::get_file_size(remote_id, remote_file_size, auth_header);
-    if (res == bridge::REQUEST_CACHED) remote_file_size = filesize_cache[remote_id].filesize; // Load size from cache
-    else if (res == bridge::REQUEST_SUCCESS) filesize_cache[remote_id].filesize = remote_file_size; // Push new size to cache
-    if (remote_file_size <= (int) offset) return 0; // Nothing to truncate here
+    long long remote_file_size = get_remote_file_size(remote_id, auth_header);
+    if (remote_file_size <= (long long) offset) return 0; // Nothing to truncate here
     if (remote_file_size != -1) {
-        LOG("[truncate]: Remote file exists and has %d bytes\n", remote_file_size);
+        LOG("[truncate]: Remote file exists and has %lld bytes\n", remote_file_size);
         // Create temp file on remote
         std::string temp_file_id;
         bool temp_open_res = bridge::file_write_open(parent_id, file_name, auth_header, temp_file_id);
         if (!temp_open_res) return -1;
-        // Read the remote file part in chunks
-        int bytes_read = 0;
-        const int CHUNK_SIZE = 4096;
-        void *buffer = malloc(CHUNK_SIZE);
-        memset(buffer, 0, CHUNK_SIZE);
+        // Copy the part of the remote file that's kept
         std::string location_hdr("sdk/v2/files/" + temp_file_id);
-        while (bytes_read != (int)offset) {
-            int local_read = 0;
-            // Calculate the number of bytes to read, not to go beyond the specified offset
-            int to_read = std::min(CHUNK_SIZE, (int)offset - bytes_read);
-            bool success = bridge::read_file(remote_id, buffer, bytes_read, to_read, local_read, auth_header);
-            LOG("[truncate]: Read %d bytes from remote; progress: %d/%d\n", local_read, bytes_read, offset);
-            if (!success) return -1;
-            bytes_read += local_read;
-            // Write file to remote temp file
-            bool write_result = bridge::write_file(auth_header, location_hdr, bytes_read - local_read, local_read, (char*) buffer);
-            if (!write_result) return -1;
-        }
-        free(buffer);
+        if (!copy_to_temp_file(remote_id, location_hdr, offset, "truncate", auth_header)) return -EIO;
         LOG("[truncate]: Remote file part copied to temp file on the remote filesystem\n");
         // Bind path to temp file
-        temp_file_binding[str_path] = temp_file_id;
+        temp_file_binding.set(str_path, temp_file_id);
         LOG("[truncate]: Temp file binding %s=>%s cached\n", path, temp_file_id.c_str());
+        invalidate_attributes(str_path);
         return 0;
     }
     return -1;
@@ -325,6 +1410,7 @@ int WdFs::utimens(const char* path, const struct timespec tv[2], struct fuse_fil
     if (tv[1].tv_sec == 0) return 0; // Can't set access time
     LOG("[utimens]: Setting epoch timestamp of %d\n", tv[1].tv_sec);
     std::string str_path(path);
+    if (set_local_modification_time(str_path, tv[1].tv_sec)) return 0;
     std::string remote_id = get_path_remote_id(str_path, auth_header);
     if (remote_id.empty()) {
         LOG("[utimens]: Failed to get the ID of the remote file\n");
@@ -335,6 +1421,8 @@ int WdFs::utimens(const char* path, const struct timespec tv[2], struct fuse_fil
         LOG("[utimens]: Failed to set modification time\n");
         return -1;
     }
+    set_listed_modification_time(str_path, tv[1].tv_sec);
+    invalidate_attributes(str_path);
     return 0;
 }
 
@@ -348,12 +1436,25 @@ int WdFs::rename(const char* old_location, const char* new_location, unsigned in
         LOG("[rename]: flag => error is thrown if target exists\n");
     }
     LOG("[rename]: flags = %u\n", flags);
-
-    // Check if the path to move/rename exists
     std::string str_old_path(old_location);
-    std::string old_id = get_path_remote_id(str_old_path, auth_header);
-    if (old_id.empty()) return -ENOENT; // Given entry doesn't exist
     std::string str_new_path(new_location);
+    // Created files that are only local yet are renamed locally, they're created under their new name by their upload
+    bool local_only = is_local_only(str_old_path);
+    bool replaces_local = is_local_only(str_new_path);
+    if (replaces_local && flags == RENAME_NOREPLACE) return -EEXIST;
+    if (writeback_mode) {
+        // Released content has to be on the remote before the entries are moved
+        if (!local_only) wait_shadow_upload(str_old_path);
+        if (!replaces_local) wait_shadow_upload(str_new_path);
+    }
+
+    // Check if the path to move/rename exists
+    std::string old_id = local_only ? std::string("") : get_path_remote_id(str_old_path, auth_header);
+    if (old_id.empty() && !local_only) return -ENOENT; // Given entry doesn't exist
+    // Released files inside a directory are uploaded before it moves
+    std::string cached_id;
+    bool is_dir = false;
+    if (!local_only && dentries.lookup(str_old_path, cached_id, is_dir) && is_dir) wait_directory_uploads(str_old_path);
     std::string new_id = get_path_remote_id(str_new_path, auth_header);
     if (!new_id.empty() && flags == RENAME_NOREPLACE) { // newpath exists and should not exist
         LOG("[rename]: RENAME_NOREPLACE flag was set and new_location exists\n");
@@ -366,6 +1467,7 @@ int WdFs::rename(const char* old_location, const char* new_location, unsigned in
             LOG("[rename]: Failed to remove already existing file!\n");
             return -1; // No specific error code for bridge failure
         }
+        if (content_cache != NULL) content_cache->invalidate(new_id);
     }
 
     // Parse new path
@@ -377,7 +1479,7 @@ int WdFs::rename(const char* old_location, const char* new_location, unsigned in
     std::string old_folder(str_old_path.substr(0, old_last_slash));
     std::string old_name(str_old_path.substr(old_last_slash + 1));
 
-    if (target_folder != old_folder) {
+    if (target_folder != old_folder && !local_only) {
         // We have to move the entry to a new folder
         std::string target_folder_id = get_path_remote_id(target_folder, auth_header);
         bool success = bridge::move_entry(old_id, target_folder_id, auth_header);
@@ -387,7 +1489,7 @@ int WdFs::rename(const char* old_location, const char* new_location, unsigned in
         }
     }
 
-    if (new_name != old_name) {
+    if (new_name != old_name && !local_only) {
         // We have to rename the entry
         bool success = bridge::rename_entry(old_id, new_name, auth_header);
         if (!success) {
@@ -396,28 +1498,273 @@ int WdFs::rename(const char* old_location, const char* new_location, unsigned in
         }
     }
 
-    // Bind the new path to the same ID (file IDs never change on remote)
-    remote_id_map[str_new_path] = remote_id_map[str_old_path];
-    // Remove the binding of the old path to the ID
-    remote_id_map.erase(str_old_path);
+    // Bind the new path to the same ID (file IDs never change on remote), entries below a directory move along
+    if (local_only || !dentries.move(str_old_path, str_new_path)) {
+        dentries.remove(str_old_path);
+        dentries.remove(str_new_path);
+    }
+
+    // New name isn't absent from the target folder anymore
+    forget_absent(get_path_remote_id(target_folder, auth_header), new_name);
+    // Link counts of the folders change if a directory moved
+    invalidate_attributes(str_new_path);
+    invalidate_attributes(old_folder);
+    invalidate_attributes(target_folder);
+    // Replaced file that's only local is dropped
+    if (replaces_local) remove_local_file(str_new_path, auth_header);
+    if (local_only) {
+        std::string target_folder_id = get_path_remote_id(target_folder, auth_header);
+        update_local_file(str_old_path, [&](buffered_file *file, shadow_entry *entry) {
+            if (file != NULL) {
+                file->path = str_new_path;
+                file->parent_id = target_folder_id;
+                file->file_name = new_name;
+                buffered_files.erase(str_old_path);
+                buffered_files[str_new_path] = file;
+                return;
+            }
+            entry->parent_id = target_folder_id;
+            entry->file_name = new_name;
+            // Created file might be partially uploaded under the old name by a failed attempt, the next upload starts over
+            if (entry->state != SHADOW_UPLOADING) entry->dirty = true;
+            shadow_files.erase(str_old_path);
+            shadow_files[str_new_path] = entry;
+        });
+    } else if (writeback_mode) {
+        // Shadow of an open file follows it, a replaced file's shadow is dropped once it's released
+        std::string target_folder_id = get_path_remote_id(target_folder, auth_header);
+        pthread_mutex_lock(&shadow_lock);
+        auto replaced = shadow_files.find(str_new_path);
+        if (replaced != shadow_files.end()) {
+            replaced->second->removed = true;
+            shadow_files.erase(replaced);
+        }
+        auto moved = shadow_files.find(str_old_path);
+        if (moved != shadow_files.end()) {
+            shadow_entry *entry = moved->second;
+            entry->parent_id = target_folder_id;
+            entry->file_name = new_name;
+            shadow_files.erase(moved);
+            shadow_files[str_new_path] = entry;
+        }
+        pthread_mutex_unlock(&shadow_lock);
+    }
 
     LOG("[rename]: Rename successful!\n");
 
     return 0;
 }
 
+// Copy the old content after the range written from the start of the file into the temp file, called with the lock of the handle held
+static bool finish_temp_file_copy(const std::string &str_path, open_file *handle, const char *operation, const std::string &auth_header) {
+    if (handle->copy_source.empty() || handle->copy_from == -1) return true;
+    // Written bytes are uploaded first, so the temp file is filled in order
+    if (handle->writer != NULL && !handle->writer->flush()) return false;
+    LOG("[%s]: Copying bytes %lld-%lld of the old content of %s to the temp file\n", operation, handle->copy_from, handle->copy_size, str_path.c_str());
+    std::string temp_file_id;
+    temp_file_binding.get(str_path, temp_file_id);
+    std::string location_hdr("sdk/v2/files/" + temp_file_id);
+    if (!copy_to_temp_file(handle->copy_source, location_hdr, handle->copy_size, operation, auth_header, handle->copy_from)) return false;
+    handle->copy_source.clear();
+    return true;
+}
+
+// Create the temp file of a read-write open on its first write, the old content is only copied once a write skips past
+// the range written from the start of the file, called with the lock of the handle held
+static bool prepare_temp_file(const std::string &str_path, open_file *handle, long long offset, long long size, const std::string &auth_header) {
+    if (handle->copy_source.empty()) return true;
+    if (handle->copy_from == -1) {
+        if (temp_file_binding.contains(str_path)) {
+            // Truncated since the open, the temp file already has the content that's kept
+            LOG("[write]: Temp file of %s was created by truncate, nothing to copy\n", str_path.c_str());
+            handle->copy_source.clear();
+            return true;
+        }
+        long long remote_file_size = get_remote_file_size(handle->copy_source, auth_header);
+        if (remote_file_size == -1) return false;
+        handle->copy_size = remote_file_size;
+        // Create temp file on remote
+        int last_slash = str_path.find_last_of('/');
+        std::string parent_id = get_path_remote_id(str_path.substr(0, last_slash), auth_header);
+        std::string temp_file_id;
+        bool temp_open_res = bridge::file_write_open(parent_id, str_path.substr(last_slash + 1) + ".bridge_temp_file", auth_header, temp_file_id);
+        if (!temp_open_res) return false;
+        // Bind path to temp file
+        temp_file_binding.set(str_path, temp_file_id);
+        LOG("[write]: Temp file binding %s=>%s cached\n", str_path.c_str(), temp_file_id.c_str());
+        handle->copy_from = 0;
+    }
+    if (offset <= handle->copy_from) {
+        // File is written from the start, the writes might replace the old content completely
+        handle->copy_from = std::max(handle->copy_from, offset + size);
+        if (handle->copy_from >= handle->copy_size) {
+            LOG("[write]: Old content of %s is overwritten, skipping the copy\n", str_path.c_str());
+            handle->copy_source.clear();
+        }
+        return true;
+    }
+    return finish_temp_file_copy(str_path, handle, "write", auth_header);
+}
+
+// Get the size of a created file that's only in memory yet, returns -1 if the path isn't one
+static long long get_buffered_size(const std::string &path) {
+    pthread_mutex_lock(&buffered_lock);
+    settle_buffered_uploads_locked();
+    auto it = buffered_files.find(path);
+    long long size = it != buffered_files.end() ? (long long)it->second->content.size() : -1;
+    pthread_mutex_unlock(&buffered_lock);
+    return size;
+}
+
+// Copy a write into the buffered content of a created file, written is false if the file isn't buffered anymore
+// or the write would make it larger than small_file_size
+static bool write_buffered_file(open_file *handle, struct fuse_bufvec *buf, long long offset, bool &written) {
+    long long size = fuse_buf_size(buf);
+    pthread_mutex_lock(&buffered_lock);
+    buffered_file *file = handle->buffered;
+    written = file != NULL && !file->spilled && offset + size <= small_file_size;
+    bool success = true;
+    if (written) {
+        if ((long long)file->content.size() < offset + size) file->content.resize(offset + size);
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT((size_t) size);
+        dst.buf[0].mem = file->content.data() + offset;
+        success = fuse_buf_copy(&dst, buf, (enum fuse_buf_copy_flags) 0) == size;
+    }
+    pthread_mutex_unlock(&buffered_lock);
+    return success;
+}
+
+// Read from the buffered content of a created file, returns -1 if the file isn't buffered anymore
+static int read_buffered_file(open_file *handle, char *buffer, long long offset, int size) {
+    pthread_mutex_lock(&buffered_lock);
+    buffered_file *file = handle->buffered;
+    int bytes_read = -1;
+    if (file != NULL && !file->spilled) {
+        bytes_read = (int)std::max(0LL, std::min((long long)size, (long long)file->content.size() - offset));
+        if (bytes_read > 0) memcpy(buffer, file->content.data() + offset, bytes_read);
+    }
+    pthread_mutex_unlock(&buffered_lock);
+    return bytes_read;
+}
+
+// Create a buffered file on the remote once it outgrew small_file_size, the content buffered so far starts its
+// resumable upload, called with the lock of the handle held
+static bool spill_buffered_file(const std::string &str_path, open_file *handle, const std::string &auth_header) {
+    pthread_mutex_lock(&buffered_lock);
+    buffered_file *file = handle->buffered;
+    handle->buffered = NULL;
+    if (file == NULL) {
+        pthread_mutex_unlock(&buffered_lock);
+        return true;
+    }
+    bool shared = --file->open_count > 0;
+    if (file->removed || file->spilled) {
+        // Nothing to create, writes to an unlinked file go nowhere and a file another open created is written directly
+        bool unlinked = file->removed;
+        if (!shared) delete file;
+        pthread_mutex_unlock(&buffered_lock);
+        return !unlinked;
+    }
+    buffered_files.erase(str_path);
+    // Other opens would keep writing to the content until the remote file exists, so it's created with the lock held
+    if (!shared) pthread_mutex_unlock(&buffered_lock);
+    LOG("[write]: %s outgrew the small file size, creating it on the remote\n", str_path.c_str());
+    std::string new_id;
+    bool success = bridge::file_write_open(file->parent_id, file->file_name, auth_header, new_id);
+    if (success) {
+        create_opened_files.set(str_path, new_id);
+        handle->writer = new write_buffer("sdk/v2/files/" + new_id, auth_header, write_buffer_size, upload_in_flight);
+        if (!file->content.empty()) success = handle->writer->write(file->content.data(), 0, (int)file->content.size());
+    }
+    if (shared) {
+        file->spilled = true;
+        pthread_mutex_unlock(&buffered_lock);
+    } else {
+        delete file;
+    }
+    return success;
+}
+
+// Share the content of a created file that's still open and only in memory with another open of its path,
+// returns NULL if the path isn't one
+static buffered_file *share_buffered_file(const std::string &path, bool truncate) {
+    pthread_mutex_lock(&buffered_lock);
+    auto it = buffered_files.find(path);
+    buffered_file *file = it != buffered_files.end() && !it->second->released ? it->second : NULL;
+    if (file != NULL) {
+        file->open_count++;
+        if (truncate) file->content.clear();
+    }
+    pthread_mutex_unlock(&buffered_lock);
+    return file;
+}
+
+// Drop the share of a released open in a buffered file, returns true if it was the last open and the file is still to be created
+static bool leave_buffered_file(buffered_file *file) {
+    pthread_mutex_lock(&buffered_lock);
+    bool last = --file->open_count == 0;
+    bool create = last && !file->spilled;
+    if (last && file->spilled) delete file;
+    pthread_mutex_unlock(&buffered_lock);
+    return create;
+}
+
 // Release an open file
-int WdFs::release(const char* file_path, struct fuse_file_info *) {
+int WdFs::release(const char* file_path, struct fuse_file_info *fi) {
     LOG("[release]: Releasing file %s\n", file_path);
+    // Upload the rest of the buffered writes and free the state of the open file, waits for prefetches still in flight
     std::string str_path(file_path);
-    if (temp_file_binding.find(str_path) != temp_file_binding.end()) {
+    open_file *handle = (open_file*) fi->fh;
+    if (handle != NULL && handle->shadow != NULL) {
+        // Upload runs in the background, the next open of the path waits for it
+        release_shadow(handle->shadow, auth_header);
+        delete handle;
+        fi->fh = 0;
+        return 0;
+    }
+    if (handle != NULL && handle->buffered != NULL) {
+        buffered_file *file = handle->buffered;
+        handle->buffered = NULL;
+        if (leave_buffered_file(file)) {
+            // Whole file is in memory, it's created with its content in a single request
+            // Nothing else keeps the content, so the upload isn't left to the background where a failure would lose it
+            delete handle;
+            fi->fh = 0;
+            bool uploaded = upload_buffered_file(file, auth_header);
+            settle_buffered_uploads();
+            return uploaded ? 0 : -EIO;
+        }
+        // Other opens still share the content, or one of them created the file on the remote and this open is released like it
+    }
+    // A failed upload leaves a hole in the temp file, it must not replace the original
+    bool uploaded = handle == NULL || handle->writer == NULL || handle->writer->flush();
+    if (!uploaded) LOG("[release]: Uploading buffered writes failed\n");
+    // Old content the writes didn't replace goes behind them
+    bool copied = uploaded && (handle == NULL || finish_temp_file_copy(str_path, handle, "release", auth_header));
+    delete handle;
+    fi->fh = 0;
+    std::string remote_temp_id, new_file_id;
+    if (!copied && temp_file_binding.take(str_path, remote_temp_id)) {
+        // Temp file is incomplete, the original file is kept
+        LOG("[release]: Temp file is incomplete, discarding the writes\n");
+        bridge::file_write_close(remote_temp_id, auth_header);
+        bridge::remove_entry(remote_temp_id, auth_header);
+        return -EIO;
+    }
+    if (!copied && create_opened_files.take(str_path, new_file_id)) {
+        // Created file is missing some of its writes, it's removed instead of being closed as complete
+        LOG("[release]: Created file is incomplete, removing it\n");
+        bridge::file_write_close(new_file_id, auth_header);
+        bridge::remove_entry(new_file_id, auth_header);
+        invalidate_attributes(str_path);
+        return -EIO;
+    }
+    if (temp_file_binding.take(str_path, remote_temp_id)) {
         // File to be released is an open temp file, close the write (upload) call here
         std::string file_name(str_path.substr(str_path.find_last_of('/') + 1));
-        std::string remote_temp_id = temp_file_binding[str_path];
         bool close_result = bridge::file_write_close(remote_temp_id, auth_header);
         if (!close_result) LOG("[release]: Remote temp file close failed\n");
         else LOG("[release]: Remote temp file closed\n");
-        temp_file_binding.erase(str_path);
         // Remove the original file
         std::string original_id = get_path_remote_id(str_path, auth_header);
         bool remove_result = bridge::remove_entry(original_id, auth_header);
@@ -425,19 +1772,23 @@ int WdFs::release(const char* file_path, struct fuse_file_info *) {
             LOG("[release]: Failed to remove old file!\n");
             return -1;
         }
+        // Content of the old file is replaced by the temp file
+        if (content_cache != NULL) content_cache->invalidate(original_id);
         // Update the ID-local cache with the new ID of the old file
-        remote_id_map[str_path] = id_cache_value(remote_temp_id, false);
+        dentries.insert(str_path, remote_temp_id, false);
+        attr_cache.erase(original_id);
+        invalidate_attributes(str_path);
         // Rename the new file
         bool rename_result = bridge::rename_entry(remote_temp_id, file_name, auth_header);
         if (!rename_result) {
             LOG("[release]: Failed to rename new file to old name!\n");
             return -1;
         }
-    } else if (create_opened_files.find(str_path) != create_opened_files.end()) {
+    } else if (create_opened_files.get(str_path, new_file_id)) {
         // File is has been created, but hasn't been closed yet
-        std::string new_file_id = create_opened_files[str_path];
         bool close_result = bridge::file_write_close(new_file_id, auth_header);
         create_opened_files.erase(str_path);
+        invalidate_attributes(str_path);
         if (!close_result) {
             LOG("[release]: Failed to close created file!\n");
             return -1;
@@ -450,84 +1801,142 @@ int WdFs::release(const char* file_path, struct fuse_file_info *) {
 int WdFs::open(const char* file_path, struct fuse_file_info *fi) {
     LOG("[open]: Opening file %s\n", file_path);
     LOG("[open]: File opened with %d mode\n", fi->flags);
+    if (writeback_mode) {
+        // Read only opens use the shadow only while it has content the remote doesn't have yet
+        int error = 0;
+        shadow_entry *entry = acquire_shadow(std::string(file_path), fi->flags != MY_O_RDONLY, error, auth_header);
+        if (error != 0) return error;
+        if (entry != NULL) {
+            open_file *handle = new open_file();
+            handle->shadow = entry;
+            fi->fh = (uint64_t) handle;
+            return 0;
+        }
+    }
+    // Close-to-open consistency, the new user sees the remote file once its upload is done
+    wait_buffered_upload(std::string(file_path));
+    // Created file that's still open isn't on the remote yet, the new open works on its content in memory
+    buffered_file *shared = share_buffered_file(std::string(file_path), fi->flags == MY_O_TRUNC);
+    if (shared != NULL) {
+        open_file *handle = new open_file();
+        handle->buffered = shared;
+        fi->fh = (uint64_t) handle;
+        return 0;
+    }
     // Ignore read only option as remote device is capable of handling offsets while reading
-    if (fi->flags == MY_O_RDONLY || fi->flags == MY_O_TRUNC) return 0;
+    if (fi->flags == MY_O_RDONLY) {
+        std::string str_path(file_path);
+        std::string file_id = get_path_remote_id(str_path, auth_header);
+        if (file_id.empty()) return -ENOENT;
+        // Size is usually cached by the getattr call preceding open, otherwise the prefetcher finds the end itself
+        long long file_size = -1;
+        filesize_cache_value cached;
+        if (filesize_cache.get(file_id, cached)) file_size = cached.filesize;
+        open_file *handle = new open_file();
+        handle->prefetch = new read_ahead(file_id, file_size, auth_header, content_cache);
+        fi->fh = (uint64_t) handle;
+        return 0;
+    }
+    if (fi->flags == MY_O_TRUNC) {
+        fi->fh = (uint64_t) new open_file();
+        return 0;
+    }
     // tempfile required because remote can't write to a file after it's closed
-    LOG("[open]: File wasn't in read only or truncate mode, preloading to remote temp file...\n");
+    // It's created and filled by the first write, opens that never write don't copy anything
+    LOG("[open]: File wasn't in read only or truncate mode, deferring the copy to a remote temp file until the first write\n");
     std::string str_path(file_path);
-    int last_slash = str_path.find_last_of('/');
-    std::string parent_path(str_path.substr(0, last_slash));
-    std::string file_name(str_path.substr(last_slash + 1) + ".bridge_temp_file");
-    LOG("[open]: Parent folder is: %s\n", parent_path.c_str());
-    LOG("[open]: Temp file name is: %s\n", file_name.c_str());
-    std::string parent_id = get_path_remote_id(parent_path, auth_header);
-    LOG("[open]: Parent folder ID is: %s\n", parent_id.c_str());
-    // Load contents of remote file into the temp file
     std::string remote_id = get_path_remote_id(str_path, auth_header);
-    int remote_file_size = -1;
-    // Get size of the remote file
-    bridge::request_result res = bridge::get_file_size(remote_id, remote_file_size, auth_header);
-    if (res == bridge::REQUEST_CACHED) remote_file_size = filesize_cache[remote_id].filesize; // Load size from cache
-    else if (res == bridge::REQUEST_SUCCESS) filesize_cache[remote_id].filesize = remote_file_size; // Push new size to cache
-    if (remote_file_size != -1) {
-        LOG("[open]: Remote file exists and has %d bytes\n", remote_file_size);
-        // Create temp file on remote
-        std::string temp_file_id;
-        bool temp_open_res = bridge::file_write_open(parent_id, file_name, auth_header, temp_file_id);
-        if (!temp_open_res) return -1;
-        // Read the remote file in chunks
-        int bytes_read = 0;
-        const int CHUNK_SIZE = 4096;
-        void *buffer = malloc(CHUNK_SIZE);
-        memset(buffer, 0, CHUNK_SIZE);
-        std::string location_hdr("sdk/v2/files/" + temp_file_id);
-        while (bytes_read != remote_file_size) {
-            int local_read = 0;
-            bool success = bridge::read_file(remote_id, buffer, bytes_read, CHUNK_SIZE, local_read, auth_header);
-            LOG("[open]: Read %d bytes from remote; progress: %d/%d\n", local_read, bytes_read, remote_file_size);
-            if (!success) return -1;
-            bytes_read += local_read;
-            // Write file to remote temp file
-            bool write_result = bridge::write_file(auth_header, location_hdr, bytes_read - local_read, local_read, (char*) buffer);
-            if (!write_result) return -1;
-        }
-        free(buffer);
-        LOG("[open]: Remote file copied to temp file on the remote filesystem\n");
-        // Bind path to temp file
-        temp_file_binding[str_path] = temp_file_id;
-        LOG("[open]: Temp file binding %s=>%s cached\n", file_path, temp_file_id.c_str());
-        return 0;
-    }
-    return -1;
+    if (remote_id.empty()) return -ENOENT;
+    open_file *handle = new open_file();
+    handle->copy_source = remote_id;
+    fi->fh = (uint64_t) handle;
+    return 0;
 }
 
-// Write bytes to a file on the remote system
-int WdFs::write(const char* file_path, const char* buffer, size_t size, off_t offset, struct fuse_file_info *) {
-    LOG("[write]: Writing %d bytes of data at %d to %s\n", size, offset, file_path);
+// Get the write buffer of an open file for a write of size bytes at offset, created by the first write,
+// returns NULL if the file isn't writable
+static write_buffer *get_file_writer(const char *file_path, open_file *handle, long long offset, long long size, const std::string &auth_header) {
+    if (handle == NULL) return NULL;
     std::string str_path(file_path);
-    std::string file_id;
-    if (temp_file_binding.find(str_path) != temp_file_binding.end()) {
+    pthread_mutex_lock(&handle->lock);
+    if (!spill_buffered_file(str_path, handle, auth_header)) {
+        LOG("[write]: Failed to create %s on the remote\n", file_path);
+        pthread_mutex_unlock(&handle->lock);
+        return NULL;
+    }
+    if (!prepare_temp_file(str_path, handle, offset, size, auth_header)) {
+        LOG("[write]: Failed to prepare the temp file of %s\n", file_path);
+        pthread_mutex_unlock(&handle->lock);
+        return NULL;
+    }
+    if (handle->writer == NULL) {
+        std::string file_id;
         // We have a temp file that's open and has the contents of the real locked file
-        file_id = temp_file_binding[str_path];
-    } else {
-        // We don't have a temp file => it's a newly created empty file that's still open for writing
-        if (create_opened_files.find(str_path) == create_opened_files.end()) {
+        if (!temp_file_binding.get(str_path, file_id)) {
+            // We don't have a temp file => it's a newly created empty file that's still open for writing
+            create_opened_files.get(str_path, file_id);
+        }
+        if (!file_id.empty()) {
+            LOG("[write]: Write target file found with ID: %s\n", file_id.c_str());
+            // Contiguous writes are uploaded in large chunks
+            handle->writer = new write_buffer("sdk/v2/files/" + file_id, auth_header, write_buffer_size, upload_in_flight);
+        } else {
             LOG("[write]: Tried to write without tempfile and file's not in created_open map!\n");
-            return -1;
         }
-        file_id = create_opened_files[str_path];
     }
-    // write the given bytes to the remote file
-    LOG("[write]: Write target file found with ID: %s\n", file_id.c_str());
-    std::string location_hdr("sdk/v2/files/" + file_id);
-    bool result = bridge::write_file(auth_header, location_hdr, (int)offset, (int)size, buffer);
-    if (!result) return -1;
-    LOG("[write]: %d bytes written to %s\n", (int)size, file_path);
+    write_buffer *writer = handle->writer;
+    pthread_mutex_unlock(&handle->lock);
+    return writer;
+}
+
+// Write bytes to a file on the remote system
+int WdFs::write(const char* file_path, const char* buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+    struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+    buf.buf[0].mem = (void*) buffer;
+    return write_buf(file_path, &buf, offset, fi);
+}
+
+// Write the content of fuse buffers to a file on the remote system, data the kernel passed in a pipe is spliced into the upload
+int WdFs::write_buf(const char* file_path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+    size_t size = fuse_buf_size(buf);
+    LOG("[write_buf]: Writing %d bytes of data at %lld to %s\n", (int)size, (long long)offset, file_path);
+    open_file *handle = (open_file*) fi->fh;
+    if (handle != NULL && handle->shadow != NULL) {
+        // Written at local disk speed, uploaded on release
+        if (!handle->shadow->file->write_buf(buf, offset)) return -EIO;
+        mark_shadow_dirty(handle->shadow);
+        return (int)size;
+    }
+    if (handle != NULL && handle->buffered != NULL) {
+        // Small created files stay in memory until release
+        bool written = false;
+        if (!write_buffered_file(handle, buf, offset, written)) return -EIO;
+        if (written) return (int)size;
+    }
+    write_buffer *writer = get_file_writer(file_path, (open_file*) fi->fh, offset, size, auth_header);
+    if (writer == NULL) return -EIO;
+    bool result = writer->write_buf(buf, offset);
+    if (!result) return -EIO;
+    LOG("[write_buf]: %d bytes written to %s\n", (int)size, file_path);
     return (int)size;
 }
 
+// Upload the buffered writes of an open file, called on every close of a file descriptor
+int WdFs::flush(const char* file_path, struct fuse_file_info *fi) {
+    LOG("[flush]: Flushing file %s\n", file_path);
+    open_file *handle = (open_file*) fi->fh;
+    if (handle == NULL || handle->writer == NULL) return 0;
+    return handle->writer->flush() ? 0 : -EIO;
+}
+
+// Upload the buffered writes of an open file
+int WdFs::fsync(const char* file_path, int, struct fuse_file_info *fi) {
+    LOG("[fsync]: Syncing file %s\n", file_path);
+    return flush(file_path, fi);
+}
+
 // Create a new file on the remote system
-int WdFs::create(const char* file_path, mode_t mode, struct fuse_file_info *) {
+int WdFs::create(const char* file_path, mode_t mode, struct fuse_file_info *fi) {
     LOG("[create]: Creating file %s\n", file_path);
     std::string str_path(file_path);
     int last_slash = str_path.find_last_of('/');
@@ -535,15 +1944,53 @@ int WdFs::create(const char* file_path, mode_t mode, struct fuse_file_info *) {
     std::string file_name(str_path.substr(last_slash + 1));
     LOG("[create]: Parent folder is: %s\n", parent_path.c_str());
     LOG("[create]: File name is: %s\n", file_name.c_str());
+    wait_buffered_upload(str_path);
     std::string parent_id = get_path_remote_id(parent_path, auth_header);
     LOG("[create]: Parent folder ID is: %s\n", parent_id.c_str());
+    if (parent_id.empty()) return -ENOENT;
+    forget_absent(parent_id, file_name);
 
-    std::string new_id;
-    bool open_result = bridge::file_write_open(parent_id, file_name, auth_header, new_id);
-    if (!open_result) return -1;
-    // Cache new file ID with the create map
-    create_opened_files[str_path] = new_id;
-    LOG("[create]: ID of the new file is: %s\n", new_id.c_str());
+    open_file *handle = new open_file();
+    if (writeback_mode) {
+        // Remote file is created by the upload once the last user released it, even if nothing was written
+        shadow_entry *entry = new shadow_entry();
+        entry->file = create_shadow_file("", 0, auth_header);
+        if (entry->file == NULL) {
+            delete entry;
+            delete handle;
+            return -EIO;
+        }
+        entry->created = true;
+        entry->parent_id = parent_id;
+        entry->file_name = file_name;
+        entry->dirty = true;
+        entry->open_count = 1;
+        pthread_mutex_lock(&shadow_lock);
+        shadow_files[str_path] = entry;
+        pthread_mutex_unlock(&shadow_lock);
+        handle->shadow = entry;
+    } else if (small_file_size > 0) {
+        // Content is buffered, release creates the file with it in a single request unless it grows too large
+        buffered_file *file = new buffered_file();
+        file->path = str_path;
+        file->parent_id = parent_id;
+        file->file_name = file_name;
+        pthread_mutex_lock(&buffered_lock);
+        buffered_files[str_path] = file;
+        pthread_mutex_unlock(&buffered_lock);
+        handle->buffered = file;
+    } else {
+        std::string new_id;
+        bool open_result = bridge::file_write_open(parent_id, file_name, auth_header, new_id);
+        if (!open_result) {
+            delete handle;
+            return -1;
+        }
+        // Cache new file ID with the create map
+        create_opened_files.set(str_path, new_id);
+        LOG("[create]: ID of the new file is: %s\n", new_id.c_str());
+    }
+    fi->fh = (uint64_t) handle;
 
     return 0;
 }
@@ -552,6 +1999,8 @@ int WdFs::create(const char* file_path, mode_t mode, struct fuse_file_info *) {
 int WdFs::rmdir(const char* dir_path) {
     LOG("[rmdir]: Removing directory%s\n", dir_path);
     std::string str_path(dir_path);
+    // Uploads into the directory have to finish before it can go
+    wait_directory_uploads(str_path);
     // Get ID of the remote directory
     std::string remote_entry_id = get_path_remote_id(str_path, auth_header);
     printf("[rmdir]: ID for remote entry is: %s\n", remote_entry_id.c_str());
@@ -559,8 +2008,11 @@ int WdFs::rmdir(const char* dir_path) {
     if (success) {
         LOG("[rmdir]: Directory remove successful\n");
         // Remove folder from the ID cache
-        remote_id_map.erase(str_path);
-        if (subfolder_count_cache.find(remote_entry_id) != subfolder_count_cache.end()) subfolder_count_cache.erase(remote_entry_id);
+        dentries.remove(str_path);
+        subfolder_count_cache.erase(remote_entry_id);
+        attr_cache.erase(remote_entry_id);
+        // Parent lost a subfolder
+        invalidate_attributes(str_path.substr(0, str_path.find_last_of('/')));
         return 0;
     }
     LOG("[rmdir]: Directory remove failed\n");
@@ -571,6 +2023,19 @@ int WdFs::rmdir(const char* dir_path) {
 int WdFs::unlink(const char* file_path) {
     LOG("[unlink]: Removing file %s\n", file_path);
     std::string str_path(file_path);
+    // Created file doesn't exist on the remote yet, nothing is uploaded for it
+    if (remove_local_file(str_path, auth_header)) return 0;
+    if (writeback_mode) {
+        wait_shadow_upload(str_path);
+        // Shadow of a file still open is dropped once it's released
+        pthread_mutex_lock(&shadow_lock);
+        auto shadow = shadow_files.find(str_path);
+        if (shadow != shadow_files.end()) {
+            shadow->second->removed = true;
+            shadow_files.erase(shadow);
+        }
+        pthread_mutex_unlock(&shadow_lock);
+    }
     // Get the ID of the remote file
     std::string remote_entry_id = get_path_remote_id(str_path, auth_header);
     printf("[unlink]: ID for remote entry is: %s\n", remote_entry_id.c_str());
@@ -578,8 +2043,11 @@ int WdFs::unlink(const char* file_path) {
     if (success) {
         LOG("[unlink]: File remove successful\n");
         // Remove file from the ID cache
-        remote_id_map.erase(str_path);
-        if (filesize_cache.find(remote_entry_id) != filesize_cache.end()) filesize_cache.erase(remote_entry_id);
+        dentries.remove(str_path);
+        filesize_cache.erase(remote_entry_id);
+        attr_cache.erase(remote_entry_id);
+        attr_generation++;
+        if (content_cache != NULL) content_cache->invalidate(remote_entry_id);
         return 0;
     }
     LOG("[unlink]: File remove failed\n");
@@ -598,39 +2066,137 @@ int WdFs::mkdir(const char* path, mode_t mode) {
     std::string prefix_id = get_path_remote_id(path_prefix, auth_header);
     LOG("[mkdir]: ID for path prefix is %s\n", prefix_id.c_str());
     std::string new_id = bridge::make_dir(folder_name, prefix_id, auth_header);
-    remote_id_map[str_path] = id_cache_value(new_id, true);
-    subfolder_count_cache[new_id] = subfolder_cache_value(0, 0);
+    forget_absent(prefix_id, folder_name);
+    dentries.insert(str_path, new_id, true);
+    subfolder_count_cache.set(new_id, subfolder_cache_value(0, 0));
+    // Parent gained a subfolder
+    invalidate_attributes(path_prefix);
     LOG("[mkdir]: Finished with new folder ID: %s\n", new_id.c_str());
     return 0;
 }
 
+// Prefetch the subfolder counts of the subfolders of a folder into subfolder_count_cache, returns false if some are unknown
+// Subfolders are listed in batches of IDs of bounded length, requested at the same time,
+// nothing is requested if the folder didn't change since the last prefetch within listing_ttl_ms
+static bool prefetch_subfolder_counts(const std::string &folder_id, const std::vector<std::string> &subfolder_ids, const std::string &auth_header) {
+    bool unchanged = false;
+    long long now = monotonic_ms();
+    list_entries_cache.read(folder_id, [&](const listing_cache_value &cached) {
+        unchanged = cached.prefetched_ms != 0 && now - cached.prefetched_ms < listing_ttl_ms;
+    });
+    if (unchanged) {
+        LOG("[readdir.subfolder_count_prefetch]: Folder is unchanged since the last prefetch\n");
+        for (const std::string &id : subfolder_ids) subfolder_count_cache.update_existing(id, [](subfolder_cache_value &v) { v.is_hot = 1; });
+        return true;
+    }
+    std::vector<std::vector<std::string>> batches;
+    std::vector<std::string> batch_params;
+    for (const std::string &id : subfolder_ids) {
+        if (batch_params.empty() || batch_params.back().size() + id.size() + 1 > MAX_PREFETCH_IDS_LENGTH) {
+            batches.emplace_back();
+            batch_params.emplace_back();
+        }
+        if (!batch_params.back().empty()) batch_params.back().append(",");
+        batch_params.back().append(id);
+        batches.back().push_back(id);
+    }
+    std::vector<std::vector<bridge::entry_data>> subfolders(batches.size());
+    std::vector<std::future<bridge::request_result>> results;
+    for (size_t i = 0; i < batches.size(); i++) results.push_back(bridge::list_entries_multiple_async(batch_params[i], auth_header, subfolders[i]));
+    // Batches are merged in order, the later ones keep arriving meanwhile
+    bool complete = true;
+    for (size_t i = 0; i < batches.size(); i++) {
+        bridge::request_result res = results[i].get();
+        if (res == bridge::REQUEST_SUCCESS) {
+            std::unordered_map<std::string, int> counts;
+            for (const auto &entry : subfolders[i]) counts[entry.parent_id] += entry.is_dir;
+            for (const std::string &id : batches[i]) subfolder_count_cache.set(id, subfolder_cache_value(1, counts[id]));
+        } else if (res == bridge::REQUEST_CACHED) {
+            // Fill subfolder_count from previously cached values
+            for (const std::string &id : batches[i]) subfolder_count_cache.update(id, [](subfolder_cache_value &v) { v.is_hot = 1; });
+        } else {
+            complete = false;
+        }
+    }
+    LOG("[readdir.subfolder_count_prefetch]: Prefetched %zu subfolders in %zu batches\n", subfolder_ids.size(), batches.size());
+    if (complete) list_entries_cache.update_existing(folder_id, [now](listing_cache_value &cached) { cached.prefetched_ms = now; });
+    return complete;
+}
+
+// Fill the attributes of a listed remote entry, subfolder_count is only used for a folder
+static void fill_entry_attributes(const bridge::entry_data &entry, int subfolder_count, struct stat *st) {
+    memset(st, 0, sizeof(struct stat));
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    // Remote doesn't track access times, entries without times are reported as changed just now
+    time_t modification_time = entry.modification_time != 0 ? entry.modification_time : time(NULL);
+    st->st_atime = modification_time;
+    st->st_mtime = modification_time;
+    st->st_ctime = entry.change_time != 0 ? entry.change_time : modification_time;
+    if (entry.is_dir) {
+        st->st_mode = S_IFDIR | 0755;
+        // '.' and '..' link to the folder too
+        st->st_nlink = exact_nlink ? 2 + subfolder_count : 1;
+    } else {
+        st->st_mode = S_IFREG | 0644;
+        st->st_nlink = 1;
+        st->st_size = entry.size;
+    }
+}
+
 // Get the attributes of the file
 int WdFs::getattr(const char *path, struct stat *st, struct fuse_file_info *) {
     LOG ("[getattr] called for path: %s\n", path);
 
     st->st_uid = getuid();
     st->st_gid = getgid();
-    // TODO: legit timestamps here
+    // Entries that aren't listed yet, like files still being written, are reported as changed just now
     st->st_atime = time(NULL);
     st->st_mtime = time(NULL);
+    st->st_ctime = time(NULL);
 
     std::string str_path(path);
+    if (writeback_mode) {
+        // Written files are served from their shadow until the upload finished
+        long long shadow_size = get_shadow_size(str_path);
+        if (shadow_size != -1) {
+            st->st_mode = S_IFREG | 0644;
+            st->st_nlink = 1;
+            st->st_size = shadow_size;
+            return 0;
+        }
+    }
+    long long buffered_size = get_buffered_size(str_path);
+    if (buffered_size != -1) {
+        // Created file is only in memory until it's released
+        st->st_mode = S_IFREG | 0644;
+        st->st_nlink = 1;
+        st->st_size = buffered_size;
+        return 0;
+    }
+    // Remote entries are only asked for again once their cached attributes expired
+    if (get_cached_attributes(str_path, st)) return 0;
+    unsigned long long generation = attr_generation;
     int subfolder_count = get_subfolder_count(str_path, auth_header);
     if (subfolder_count > -1) { // entry is a folder
         st->st_mode = S_IFDIR | 0755;
         LOG("[getattr] Path %s has %d subfolders\n", path, subfolder_count);
         // 2 + subfolder_count, because of the '.' and '..' special directories
-        st->st_nlink = 2 + subfolder_count;
+        st->st_nlink = exact_nlink ? 2 + subfolder_count : 1;
+        set_listed_times(str_path, st);
+        cache_attributes(str_path, st, generation);
     } else if (subfolder_count == -1) { // entry is a file
         LOG("[getattr] Path %s is a file\n", path);
         st->st_mode = S_IFREG | 0644;
         st->st_nlink = 1;
-        int file_size = path_get_size(str_path, auth_header);
-        LOG("[getattr]: Size of %s is %d bytes\n", path, file_size);
+        long long file_size = path_get_size(str_path, auth_header);
+        LOG("[getattr]: Size of %s is %lld bytes\n", path, file_size);
         if (file_size == -1) return -ENOENT; // ID of the file is invalid or size can't be requested
         st->st_size = file_size;
+        set_listed_times(str_path, st);
+        cache_attributes(str_path, st, generation);
     } else { // entry doesn't exist or is not listable by server becuase it's still open for writing
-            if (create_opened_files.find(str_path) != create_opened_files.end()) {
+            if (create_opened_files.contains(str_path)) {
                 // This hack is required here, because the remote device doesn't list the file unless the write to it has been ended with file_write_close
                 // The file is kept open after the create operation, because a write call might be the next and it's not possible to write to a remote file if it's been closed
                 st->st_mode = S_IFREG | 0644;
@@ -652,60 +2218,62 @@ int WdFs::readdir(const char *path , void *buffer, fuse_fill_dir_t filler,
     // Get entry list of the remote directory
     std::vector<bridge::entry_data> entries;
     std::string str_path(path);
-    std::string subfolder_id_param;
     std::vector<std::string> subfolder_ids;
     list_entries_result expand_result = list_entries_expand(str_path, &entries, auth_header);
     if (expand_result == FOLDER_FOUND) { // has entry and it's a directory
         LOG("[readdir] Given path is a folder\n");
+        unsigned long long generation = attr_generation;
         for (int i = 0; i < entries.size(); i++) {
             // Insert entries to ID cache
             bridge::entry_data current = entries[i];
             std::string cache_key(str_path + (str_path == "/" ? "" : "/") + current.name);
-            remote_id_map[cache_key] = id_cache_value(current.id, current.is_dir);
-            // Send the entry's name to the system
-            filler(buffer, current.name.c_str(), NULL, 0, FUSE_FILL_DIR_PLUS);
+            dentries.insert(cache_key, current.id, current.is_dir);
             if (current.is_dir) { // Prepare subfolder count prefetching
-                subfolder_id_param.append(current.id);
-                subfolder_id_param.append(",");
                 subfolder_ids.emplace_back(current.id);
-                subfolder_count_cache[current.id] = subfolder_cache_value(1, 0);
             } else {
                 // Cache prefetched file sizes
-                filesize_cache[current.id] = filesize_cache_value(1, current.size);
+                filesize_cache.set(current.id, filesize_cache_value(1, current.size));
+                if (content_cache != NULL) content_cache->validate(current.id, current.size, "", current.modification_time);
             }
         }
 
-        LOG("[readdir.cache_remote_id] Listing remote id cache:\n");
-        for (auto& [curpath, entry] : remote_id_map) {
-            LOG("%s => %s\n", curpath.c_str(), entry.id.c_str());
+        // Prefetch subfolder counts for the link counts of the subfolders, only if they're exact and sent with the entries,
+        // getattr counts the subfolders of a single folder when it's asked for it
+        bool plus = (flags & FUSE_READDIR_PLUS) != 0;
+        bool counts_known = !exact_nlink || subfolder_ids.empty();
+        if (exact_nlink && plus && !subfolder_ids.empty()) {
+            std::string folder_id;
+            bool is_dir = false;
+            dentries.lookup(str_path, folder_id, is_dir);
+            counts_known = !folder_id.empty() && prefetch_subfolder_counts(folder_id, subfolder_ids, auth_header);
         }
 
-        // Prefetch subfolder counts
-        if (!subfolder_id_param.empty()) subfolder_id_param.pop_back(); // Remove trailing "," from the parameter
-        std::vector<bridge::entry_data> subfolders;
-        bridge::request_result res = bridge::list_entries_multiple(subfolder_id_param, auth_header, subfolders);
-        if (res == bridge::REQUEST_SUCCESS) {
-            LOG("[readdir.subfolder_count_prefetch]: Server sent subfolder data\n");
-            for (const auto& entry : subfolders) {
-                subfolder_count_cache[entry.parent_id].subfolder_count += entry.is_dir;
-            }
-        } else if (res == bridge::REQUEST_CACHED) {
-            // Fill subfolder_count from previously cached values
-            LOG("[readdir.subfolder_count_prefetch]: Server sent cache is valid\n");
-            for (const std::string& id : subfolder_ids) {
-                subfolder_count_cache[id].is_hot = 1;
-            }
-        }
+        // Size and times of files with pending writes are local, getattr serves them instead of the listing
+        std::vector<std::string> pending_names;
+        list_local_files(str_path, pending_names, true);
+        std::unordered_set<std::string> pending(pending_names.begin(), pending_names.end());
 
-        LOG("[readdir.subfolder_count_prefetch] Listing subfolder count cache:\n");
-        for (const auto& [id, entry] : subfolder_count_cache) {
-            LOG("%s => %d\n", id.c_str(), entry.subfolder_count);
+        // Send the entries to the system, with their attributes if it asked for them, so it doesn't stat every entry after the listing
+        for (const auto &current : entries) {
+            struct stat st;
+            subfolder_cache_value count;
+            bool has_attributes = pending.find(current.name) == pending.end() &&
+                (!current.is_dir || !exact_nlink || (counts_known && subfolder_count_cache.get(current.id, count)));
+            if (has_attributes) {
+                fill_entry_attributes(current, count.subfolder_count, &st);
+                cache_attributes(str_path + (str_path == "/" ? "" : "/") + current.name, &st, generation);
+            }
+            filler(buffer, current.name.c_str(), plus && has_attributes ? &st : NULL, 0, FUSE_FILL_DIR_PLUS);
         }
-
-        // Print the prefetched file sizes
-        LOG("[readdir.filesize_count_prefetch] Listing file size cache:\n");
-        for (const auto& [id, entry]: filesize_cache) {
-            LOG("%s => %d\n", id.c_str(), entry.filesize);
+        // Files whose upload hasn't finished are listed too, getattr serves them locally
+        std::vector<std::string> local_names;
+        list_local_files(str_path, local_names);
+        if (!local_names.empty()) {
+            std::unordered_set<std::string> listed;
+            for (const auto &entry : entries) listed.insert(entry.name);
+            for (const std::string &name : local_names) {
+                if (listed.insert(name).second) filler(buffer, name.c_str(), NULL, 0, FUSE_FILL_DIR_PLUS);
+            }
         }
         return 0;
     } else if (expand_result == FILE_FOUND) {  // has entry but it's a file
@@ -717,17 +2285,174 @@ int WdFs::readdir(const char *path , void *buffer, fuse_fill_dir_t filler,
 }
 
 // Read the contents of a remote file
-int WdFs::read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *) {
+int WdFs::read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
     LOG("[read]: Requesting content for file %s [%d:%d]\n", path, offset, offset + size);
+    open_file *handle = (open_file*) fi->fh;
+    if (handle != NULL && handle->shadow != NULL) {
+        int bytes_read = handle->shadow->file->read(buffer, offset, (int)size);
+        return bytes_read < 0 ? -EIO : bytes_read;
+    }
+    if (handle != NULL && handle->buffered != NULL) {
+        int bytes_read = read_buffered_file(handle, buffer, offset, (int)size);
+        if (bytes_read >= 0) return bytes_read;
+    }
     std::string str_path(path);
     std::string file_id = get_path_remote_id(str_path, auth_header);
     LOG("[read]: File ID on the remote is: %s\n", file_id.c_str());
     if (file_id.empty()) return -1;
 
+    if (handle != NULL && handle->prefetch != NULL) {
+        // Sequential reads are served from the prefetched window
+        int bytes_read = handle->prefetch->read(buffer, offset, (int)size);
+        LOG("[read]: Bytes read through read ahead: %d\n", bytes_read);
+        return bytes_read;
+    }
+
     int bytes_read = 0;
-    bool success = bridge::read_file(file_id, buffer, (int)offset, (int)size, bytes_read, auth_header);
+    bool success = bridge::read_file(file_id, buffer, offset, (int)size, bytes_read, auth_header);
     LOG("[read]: Actual bytes read from file: %d\n", bytes_read);
     return (!success * -1) + (success * bytes_read);
     //if (!success) return -1;
     //return bytes_read;
 }
+
+// Get a descriptor of a block stored by the disk cache, returns -1 if the block isn't stored
+static int get_block_fd(open_file *handle, const std::string &file_id, long long block, long long &block_size) {
+    pthread_mutex_lock(&handle->lock);
+    for (const block_fd &b : handle->block_fds) {
+        if (b.block == block) {
+            block_size = b.size;
+            pthread_mutex_unlock(&handle->lock);
+            return b.fd;
+        }
+    }
+    int fd = disk_content_cache->open_block(file_id, block, block_size);
+    if (fd != -1) {
+        handle->block_fds.push_back(block_fd { block, block_size, fd });
+        if ((int)handle->block_fds.size() > MAX_BLOCK_FDS) {
+            close(handle->block_fds.front().fd);
+            handle->block_fds.pop_front();
+        }
+    }
+    pthread_mutex_unlock(&handle->lock);
+    return fd;
+}
+
+// Read the contents of a remote file into buffers owned by libfuse
+// Blocks stored by the disk cache are passed as file descriptors, so the kernel can splice them
+int WdFs::read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+    LOG("[read_buf]: Requesting content for file %s [%lld:%lld]\n", path, (long long)offset, (long long)offset + size);
+    open_file *handle = (open_file*) fi->fh;
+    if (handle != NULL && handle->shadow != NULL) {
+        // Missing blocks are fetched into the shadow, the kernel reads the rest from the local file
+        shadow_file *shadow = handle->shadow->file;
+        long long available = std::max(0LL, std::min((long long)size, shadow->size() - offset));
+        if (!shadow->fill(offset, available)) return -EIO;
+        struct fuse_bufvec *bufv = (struct fuse_bufvec*) malloc(sizeof(struct fuse_bufvec));
+        if (bufv == NULL) return -ENOMEM;
+        *bufv = FUSE_BUFVEC_INIT((size_t) available);
+        bufv->buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+        bufv->buf[0].fd = shadow->fd();
+        bufv->buf[0].pos = offset;
+        *bufp = bufv;
+        return 0;
+    }
+    // Every block the request touches may need a buffer of its own
+    size_t max_buffers = size / block_cache::BLOCK_SIZE + 2;
+    struct fuse_bufvec *bufv = (struct fuse_bufvec*) malloc(sizeof(struct fuse_bufvec) + (max_buffers - 1) * sizeof(struct fuse_buf));
+    if (bufv == NULL) return -ENOMEM;
+    *bufv = FUSE_BUFVEC_INIT(0);
+    bufv->count = 0;
+
+    if (handle == NULL || handle->prefetch == NULL || content_cache == NULL) {
+        // No cached blocks to hand out, read into a single buffer
+        void *mem = malloc(size);
+        int bytes_read = mem == NULL ? -ENOMEM : read(path, (char*) mem, size, offset, fi);
+        if (bytes_read < 0) {
+            free(mem);
+            free(bufv);
+            return bytes_read;
+        }
+        bufv->buf[0].mem = mem;
+        bufv->buf[0].size = bytes_read;
+        bufv->count = 1;
+        *bufp = bufv;
+        return 0;
+    }
+
+    std::string file_id = get_path_remote_id(std::string(path), auth_header);
+    if (file_id.empty()) {
+        free(bufv);
+        return -ENOENT;
+    }
+    size_t done = 0;
+    while (done < size) {
+        long long position = offset + done;
+        long long block = position / block_cache::BLOCK_SIZE;
+        long long block_offset = position - block * block_cache::BLOCK_SIZE;
+        size_t wanted = std::min(size - done, (size_t)(block_cache::BLOCK_SIZE - block_offset));
+        struct fuse_buf &buf = bufv->buf[bufv->count];
+        buf = FUSE_BUFVEC_INIT(0).buf[0];
+
+        long long block_size = -1;
+        block_data data = content_cache->lookup_memory(file_id, block);
+        int fd = -1;
+        if (data == NULL && disk_content_cache != NULL) fd = get_block_fd(handle, file_id, block, block_size);
+        if (data == NULL && fd == -1) {
+            // Not cached, the prefetcher brings the block into the cache and it's served from there like a hit,
+            // from the disk cache first so the kernel reads it from the block file without another copy
+            if (handle->prefetch->read(NULL, position, (int)wanted) < 0) {
+                if (done == 0) {
+                    free(bufv);
+                    return -EIO;
+                }
+                break;
+            }
+            if (disk_content_cache != NULL) fd = get_block_fd(handle, file_id, block, block_size);
+            if (fd == -1) data = content_cache->lookup_memory(file_id, block);
+        }
+        size_t available = 0;
+        if (fd != -1) {
+            // Block is on the disk, the kernel reads it from the file
+            available = std::min(wanted, (size_t)std::max(0LL, block_size - block_offset));
+            buf.flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+            buf.fd = fd;
+            buf.pos = block_offset;
+        } else if (data != NULL) {
+            // Block is in memory, libfuse frees the buffers it gets so the block is copied once
+            available = std::min(wanted, (size_t)std::max(0LL, (long long)data->size() - block_offset));
+            buf.mem = malloc(available);
+            if (buf.mem != NULL) memcpy(buf.mem, data->data() + block_offset, available);
+            else available = 0;
+        } else {
+            // Cache didn't keep the block, it's read once more into a buffer of its own
+            buf.mem = malloc(wanted);
+            int bytes_read = buf.mem == NULL ? -1 : handle->prefetch->read((char*) buf.mem, position, (int)wanted);
+            if (bytes_read < 0) {
+                free(buf.mem);
+                buf.mem = NULL;
+                if (done == 0) {
+                    free(bufv);
+                    return -EIO;
+                }
+                break;
+            }
+            available = bytes_read;
+        }
+
+        if (available == 0) {
+            free(buf.mem);
+            buf = FUSE_BUFVEC_INIT(0).buf[0];
+            break;
+        }
+        buf.size = available;
+        bufv->count++;
+        done += available;
+        if (available < wanted) break; // End of the file
+    }
+
+    // libfuse expects at least one buffer
+    if (bufv->count == 0) bufv->count = 1;
+    *bufp = bufv;
+    return 0;
+}
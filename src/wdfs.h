@@ -10,6 +10,39 @@ enum list_entries_result {
     FILE_FOUND,
     NOT_FOUND
 };
+
+// Tunables of the file system, set from the mount options
+struct WdFsOptions {
+    // Memory used for caching file content in bytes
+    long long cache_size;
+    // Directory of the on-disk content cache and the bytes it may use, empty or 0 disables it
+    std::string cache_dir;
+    long long disk_cache_size;
+    // Bytes of contiguous writes collected into a single upload
+    int write_buffer_size;
+    // Bytes being uploaded at the same time for an open file
+    long long upload_in_flight;
+    // Created files up to this many bytes are uploaded in a single request on release, 0 disables it
+    long long small_file_size;
+    // Seconds a cached folder listing is used to resolve the paths below it without asking the remote
+    int listing_ttl;
+    // Seconds a name missing from an unchanged folder is answered as absent without asking the remote
+    int negative_ttl;
+    // Seconds the kernel and getattr cache lookups and attributes, and the kernel caches missing names
+    int entry_timeout;
+    int attr_timeout;
+    int negative_timeout;
+    // Directories report their subfolder count in their link count, which lists every subfolder along with its folder
+    bool exact_nlink;
+    // Uploads of released shadow files running at the same time
+    int upload_workers;
+    // Bytes of released shadow files waiting for their upload, release waits while they're exceeded
+    long long upload_disk;
+    // Writes go to local shadow files under shadow_dir, which are uploaded in the background once released
+    bool writeback;
+    std::string shadow_dir;
+};
+
 class WdFs : public Fusepp::Fuse<WdFs> {
     private:
         static std::string auth_header;
@@ -19,17 +52,24 @@ class WdFs : public Fusepp::Fuse<WdFs> {
         static int getattr(const char*, struct stat*, struct fuse_file_info *);
         static int readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags);
         static int read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi);
+        static int read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi);
         static int mkdir(const char* path, mode_t mode);
         static int unlink(const char* file_path);
         static int rmdir(const char* dir_path);
         static int write(const char* file_path, const char* buffer, size_t size, off_t offset, struct fuse_file_info *);
+        static int write_buf(const char* file_path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *);
+        static int flush(const char* file_path, struct fuse_file_info *);
+        static int fsync(const char* file_path, int datasync, struct fuse_file_info *);
         static int create(const char* file_path, mode_t mode, struct fuse_file_info *);
         static int open(const char* file_path, struct fuse_file_info *);
         static int release(const char* file_path, struct fuse_file_info *);
         static int rename(const char* oldname, const char* newname, unsigned int flags);
         static int utimens(const char* path, const struct timespec tv[2], struct fuse_file_info *fi);
         static int truncate(const char* path, off_t offset, struct fuse_file_info *fi);
+        static void *init(struct fuse_conn_info *conn, struct fuse_config *cfg);
+        static void destroy(void *private_data);
         static void set_authorization_header(std::string authorization_header);
+        static void set_options(const WdFsOptions &options);
 };
 
 #endif
@@ -0,0 +1,117 @@
+#include "write_buffer.hpp"
+#include "bridge.hpp"
+#include "log.h"
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <chrono>
+
+write_buffer::write_buffer(const std::string &_file_location, const std::string &_auth_header, int _capacity, long long _in_flight_budget) : file_location(_file_location), auth_header(_auth_header), capacity(_capacity), in_flight_budget(std::max((long long)_capacity, _in_flight_budget)) {
+    pthread_mutex_init(&lock, NULL);
+}
+
+write_buffer::~write_buffer() {
+    // Transfers still read from the staging files
+    while (!in_flight.empty()) wait_oldest();
+    if (staging_fd != -1) close(staging_fd);
+    pthread_mutex_destroy(&lock);
+}
+
+// Wait for the oldest upload in flight to finish
+void write_buffer::wait_oldest() {
+    pending_upload *p = in_flight.front();
+    in_flight.pop_front();
+    if (!p->result.get()) {
+        LOG("[write_buffer]: Upload of %lld bytes at %lld to %s failed\n", p->size, p->offset, file_location.c_str());
+        failed = true;
+    }
+    in_flight_bytes -= p->size;
+    close(p->fd);
+    delete p;
+}
+
+// Check if a range of the file is part of an upload in flight
+bool write_buffer::overlaps_in_flight(long long offset, long long size) const {
+    for (const pending_upload *p : in_flight) {
+        if (offset < p->offset + p->size && p->offset < offset + size) return true;
+    }
+    return false;
+}
+
+// Start uploading the buffered bytes as a single PUT
+bool write_buffer::upload() {
+    // Collect the uploads that are done without waiting
+    while (!in_flight.empty() && in_flight.front()->result.wait_for(std::chrono::seconds(0)) == std::future_status::ready) wait_oldest();
+    if (staged == 0) return !failed;
+    // Writer has to wait until the link catches up
+    while (!in_flight.empty() && in_flight_bytes + staged > in_flight_budget) wait_oldest();
+    // Rewritten ranges must reach the remote after the earlier bytes they replace
+    while (overlaps_in_flight(buffer_offset, staged)) wait_oldest();
+
+    LOG("[write_buffer]: Uploading %lld bytes at %lld to %s\n", staged, buffer_offset, file_location.c_str());
+    pending_upload *p = new pending_upload();
+    p->offset = buffer_offset;
+    p->size = staged;
+    p->fd = staging_fd;
+    p->result = bridge::write_file_from_fd_async(auth_header, file_location, p->offset, p->size, p->fd, 0);
+    in_flight.push_back(p);
+    in_flight_bytes += p->size;
+    buffer_offset += staged;
+    staging_fd = -1;
+    staged = 0;
+    return !failed;
+}
+
+bool write_buffer::write(const char *buffer, long long offset, int size) {
+    struct fuse_bufvec src = FUSE_BUFVEC_INIT((size_t) size);
+    src.buf[0].mem = (void*) buffer;
+    return write_buf(&src, offset);
+}
+
+bool write_buffer::write_buf(struct fuse_bufvec *buf, long long offset) {
+    long long size = fuse_buf_size(buf);
+    pthread_mutex_lock(&lock);
+    // Buffer only holds a contiguous range
+    if (staged > 0 && offset != buffer_offset + staged) upload();
+    if (staged == 0) buffer_offset = offset;
+
+    long long copied = 0;
+    while (copied < size && !failed) {
+        if (staging_fd == -1) {
+            // Staging files live in memory, the kernel moves pages into them without a userspace copy
+            staging_fd = memfd_create("wdfs_write_buffer", MFD_CLOEXEC);
+            if (staging_fd == -1) {
+                LOG("[write_buffer]: Failed to create a staging file: %s\n", strerror(errno));
+                failed = true;
+                break;
+            }
+        }
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT((size_t) std::min(size - copied, capacity - staged));
+        dst.buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+        dst.buf[0].fd = staging_fd;
+        dst.buf[0].pos = staged;
+        // Source position is advanced by the copy
+        ssize_t res = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_MOVE);
+        if (res <= 0) {
+            LOG("[write_buffer]: Failed to stage %lld bytes for %s\n", size - copied, file_location.c_str());
+            failed = true;
+            break;
+        }
+        copied += res;
+        staged += res;
+        if (staged == capacity) upload();
+    }
+    bool success = !failed;
+    pthread_mutex_unlock(&lock);
+    return success;
+}
+
+bool write_buffer::flush() {
+    pthread_mutex_lock(&lock);
+    upload();
+    while (!in_flight.empty()) wait_oldest();
+    bool success = !failed;
+    pthread_mutex_unlock(&lock);
+    return success;
+}
@@ -0,0 +1,61 @@
+#ifndef __WRITE_BUFFER_HPP_
+#define __WRITE_BUFFER_HPP_
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 35
+#endif
+
+#include "pthread.h"
+#include <fuse.h>
+#include <string>
+#include <deque>
+#include <future>
+
+// Collects contiguous writes of an open file and uploads them as large chunks,
+// several chunks are uploaded at the same time
+class write_buffer {
+    public:
+        // file_location is the location header of the resumable remote file, capacity is the chunk size in bytes,
+        // in_flight_budget is the number of bytes being uploaded at most before writes have to wait
+        write_buffer(const std::string &file_location, const std::string &auth_header, int capacity, long long in_flight_budget);
+        // Waits for the uploads still in flight
+        ~write_buffer();
+
+        // Buffer bytes written at offset, returns false if an upload failed
+        bool write(const char *buffer, long long offset, int size);
+        // Buffer the content of a fuse buffer written at offset, fd backed buffers are spliced
+        bool write_buf(struct fuse_bufvec *buf, long long offset);
+        // Upload the buffered bytes and wait for every upload, returns false if any of them failed
+        bool flush();
+
+    private:
+        // A chunk being uploaded, the body is streamed from its staging file
+        struct pending_upload {
+            long long offset;
+            long long size;
+            int fd;
+            std::future<bool> result;
+        };
+
+        std::string file_location;
+        std::string auth_header;
+        int capacity;
+        // Offset of the first buffered byte in the file
+        long long buffer_offset = 0;
+        // Staging file of the chunk being collected and the number of bytes in it
+        int staging_fd = -1;
+        long long staged = 0;
+        long long in_flight_budget;
+        long long in_flight_bytes = 0;
+        // Uploads in the order they were started
+        std::deque<pending_upload*> in_flight;
+        // Set once an upload failed, the file on the remote is incomplete from then on
+        bool failed = false;
+        pthread_mutex_t lock;
+
+        bool upload();
+        void wait_oldest();
+        bool overlaps_in_flight(long long offset, long long size) const;
+};
+
+#endif